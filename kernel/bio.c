@@ -1,9 +1,10 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
-// cached copies of disk block contents.  Caching disk blocks
-// in memory reduces the number of disk reads and also provides
-// a synchronization point for disk blocks used by multiple processes.
+// The buffer cache is a set of hash buckets, each a linked list
+// of buf structures holding cached copies of disk block contents.
+// Caching disk blocks in memory reduces the number of disk reads
+// and also provides a synchronization point for disk blocks used
+// by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
@@ -12,6 +13,46 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// A block's hash chain is chosen by hashing (dev, blockno).
+// There are enough chains to keep them short even once the
+// cache has grown as large as BUFMAXPG lets it. The chains
+// share the locks of NBUCKET buckets: chain h belongs to bucket
+// h % NBUCKET, whose lock protects the chain, and the dev,
+// blockno, refcnt and lastuse of the bufs on it, so lookups of
+// different blocks seldom contend. Recycling a buffer moves it
+// between chains; bcache.lock serializes that, so that one
+// block can't end up cached twice.
+//
+// Lock order: bcache.lock before any bucket lock. Without
+// bcache.lock, hold at most one bucket lock. With it, bucket
+// locks may be nested, but only in increasing bucket order.
+// The recycler holds up to three while it scans: the buckets
+// of its best probationary and best hot candidates, and the
+// one it's looking through. bcacheshrink() holds them all.
+//
+// Bufs that have never held a block wait on bcache.free, and a
+// miss takes one from there if it can. Besides the NBUF bufs in
+// bcache.buf, the cache grows by a page of bufs on a miss that
+// finds bcache.free empty while more than bcache.hiwat pages
+// are free, up to BUFMAXPG pages; only when it can't does the
+// miss recycle a buf. kalloc() calls bcacheshrink() to give
+// unused pages back when fewer than bcache.lowat are free. The
+// watermarks start as BUFHIWAT and BUFLOWAT, and bcachewat()
+// changes them. bcacheshrink() counts the
+// bufs in use on each page, so it can tell at once when no page
+// is free to give back.
+//
+// Replacement is 2Q, so that a sequential scan can't flush the
+// blocks that are used over and over (inodes, bitmaps,
+// directories). A block read in for the first time is on
+// probation (b->hot == 0); probationary bufs are recycled in
+// FIFO order, and only while they're more than a quarter of the
+// cache, or nothing else is unused. The blocks they held are
+// remembered in a ghost ring, and a block that is read in again
+// while still remembered there comes back hot. Hot bufs are
+// recycled least recently used first. With BUF2Q 0 in param.h,
+// every block is hot, which is plain LRU.
 
 
 #include "types.h"
@@ -23,69 +64,400 @@
 #include "fs.h"
 #include "buf.h"
 
+#define NBUCKET 13
+
+// bufs that fit in a page, after bufpage.next and nbusy.
+#define BPERPAGE ((PGSIZE - 2*sizeof(void*)) / sizeof(struct buf))
+
+// about two bufs per chain when the cache is as big as it gets.
+// a multiple of NBUCKET, so that the chains of a bucket are
+// those h with h % NBUCKET the same.
+#define NBUFMAX (NBUF + BUFMAXPG * (int)BPERPAGE)
+#define NCHAIN (NBUCKET * ((NBUFMAX/2 + NBUCKET-1) / NBUCKET))
+#define BHASH(dev, blockno) (((dev) * 7 + (blockno)) % NCHAIN)
+#define BUCKET(h) (&bcache.bucket[(h) % NBUCKET])
+
+struct bucket {
+  struct spinlock lock;   // protects the chains h with h % NBUCKET == this one
+  uint64 nhit;       // lookups that found the block cached
+  uint64 nmiss;      // lookups that had to recycle a buffer
+};
+
+// blocks recently recycled from probation.
+#define NGHOST 128
+
+struct ghost {
+  uint dev;
+  uint blockno;
+};
+
+struct bufpage {
+  struct bufpage *next;
+  int nbusy;              // bufs with refcnt != 0
+  struct buf buf[BPERPAGE];
+};
+
 struct {
-  struct spinlock lock;
+  struct spinlock lock;   // serializes recycling, growing and shrinking
   struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
+  struct buf *chain[NCHAIN];  // lists through next and pprev
+  struct bufpage *pages;  // pages of bufs added by bgrow()
+  int npage;
+  int nidle;              // pages with nbusy == 0
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // protected by bcache.lock:
+  struct buf *free;       // bufs that have never held a block
+  int hiwat;              // grow only while more pages are free
+  int lowat;              // shrink when fewer are free; kalloc() reads it
+  int nprobation;         // bufs on chains with hot == 0
+  struct ghost ghost[NGHOST];
+  int ghostnext;          // ring slot to overwrite next
 } bcache;
 
+#define NBUFS() (NBUF + bcache.npage * (int)BPERPAGE)
+
+// Take b off its chain. Caller holds its bucket's lock.
+static void
+bunlink(struct buf *b)
+{
+  *b->pprev = b->next;
+  if(b->next)
+    b->next->pprev = b->pprev;
+}
+
+// Put b on the list at *head: a chain, whose bucket's lock
+// the caller holds, or bcache.free.
+static void
+blink(struct buf **head, struct buf *b)
+{
+  b->next = *head;
+  if(b->next)
+    b->next->pprev = &b->next;
+  b->pprev = head;
+  *head = b;
+}
+
+// The page bgrow() carved b from, or 0 if b is in bcache.buf.
+static struct bufpage*
+bpage(struct buf *b)
+{
+  if(b >= bcache.buf && b < bcache.buf+NBUF)
+    return 0;
+  return (struct bufpage*)PGROUNDDOWN((uint64)b);
+}
+
+// Take a reference to b, or drop one. Caller holds b's bucket's
+// lock, or bcache.lock if b is on bcache.free. Another bucket's
+// bufs may share the page, so nbusy and nidle are atomic; nidle
+// can be off by one for a moment, even negative.
+static void
+bhold(struct buf *b)
+{
+  struct bufpage *pg;
+
+  if(b->refcnt++ == 0 && (pg = bpage(b)) != 0 &&
+     __atomic_fetch_add(&pg->nbusy, 1, __ATOMIC_RELAXED) == 0)
+    __atomic_fetch_sub(&bcache.nidle, 1, __ATOMIC_RELAXED);
+}
+
+static void
+bdrop(struct buf *b)
+{
+  struct bufpage *pg;
+
+  if(--b->refcnt == 0 && (pg = bpage(b)) != 0 &&
+     __atomic_fetch_sub(&pg->nbusy, 1, __ATOMIC_RELAXED) == 1)
+    __atomic_fetch_add(&bcache.nidle, 1, __ATOMIC_RELAXED);
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  bcache.hiwat = BUFHIWAT;
+  bcache.lowat = BUFLOWAT;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    blink(&bcache.free, b);
+  }
+}
+
+// Add a page of bufs to bcache.free, for the next misses.
+// Caller holds bcache.lock. Returns -1 if out of memory, or
+// the cache has grown by BUFMAXPG pages already.
+static int
+bgrow(void)
+{
+  struct bufpage *pg;
+  struct buf *b;
+
+  if(bcache.npage >= BUFMAXPG || (pg = kalloc()) == 0)
+    return -1;
+  memset(pg, 0, PGSIZE);
+  for(b = pg->buf; b < pg->buf+BPERPAGE; b++)
+    initsleeplock(&b->lock, "buffer");
+
+  for(b = pg->buf; b < pg->buf+BPERPAGE; b++)
+    blink(&bcache.free, b);
+
+  pg->next = bcache.pages;
+  bcache.pages = pg;
+  __atomic_store_n(&bcache.npage, bcache.npage + 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&bcache.nidle, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// Give pages of bufs back to kalloc() until bcache.lowat pages
+// are free, or at least one, if no buf on them is in use.
+// Returns the number of pages freed.
+int
+bcacheshrink(void)
+{
+  struct bufpage *pg, **pp, *freed = 0;
+  struct buf *b;
+  int i, n, want, busy;
+
+  // kalloc() calls this often when memory is short; don't take
+  // every lock just to find that every page is in use.
+  if(__atomic_load_n(&bcache.nidle, __ATOMIC_RELAXED) <= 0)
+    return 0;
+
+  // called by kalloc(), perhaps from bgrow().
+  push_off();
+  busy = holding(&bcache.lock);
+  pop_off();
+  if(busy)
+    return 0;
+
+  // with bcache.lock and every bucket lock held,
+  // no buf's refcnt can change.
+  acquire(&bcache.lock);
+  for(i = 0; i < NBUCKET; i++)
+    acquire(&bcache.bucket[i].lock);
+
+  want = bcache.lowat - kfreepages();
+  if(want < 1)
+    want = 1;
+  n = 0;
+  for(pp = &bcache.pages; (pg = *pp) != 0 && n < want; ){
+    if(pg->nbusy != 0){
+      pp = &pg->next;
+      continue;
+    }
+    for(b = pg->buf; b < pg->buf+BPERPAGE; b++){
+      bunlink(b);
+      if(b->lastuse != 0 && !b->hot)  // on a chain, on probation
+        bcache.nprobation--;
+    }
+    *pp = pg->next;
+    pg->next = freed;
+    freed = pg;
+    n++;
+  }
+  __atomic_store_n(&bcache.npage, bcache.npage - n, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&bcache.nidle, n, __ATOMIC_RELAXED);
+
+  for(i = NBUCKET-1; i >= 0; i--)
+    release(&bcache.bucket[i].lock);
+  release(&bcache.lock);
+
+  while((pg = freed) != 0){
+    freed = pg->next;
+    for(b = pg->buf; b < pg->buf+BPERPAGE; b++)
+      freesleeplock(&b->lock);
+    kfree(pg);
+  }
+  return n;
+}
+
+// Was the block recycled from probation not long ago? If so,
+// forget it: it's about to be cached again, hot.
+// Caller holds bcache.lock.
+static int
+ghosthit(uint dev, uint blockno)
+{
+  struct ghost *g;
+
+  for(g = bcache.ghost; g < bcache.ghost+NGHOST; g++){
+    if(g->dev == dev && g->blockno == blockno){
+      g->dev = 0;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Look for the block on chain h, and take a reference
+// if it's there. Caller holds the chain's bucket's lock.
+static struct buf*
+bfind(int h, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bcache.chain[h]; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      bhold(b);
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Choose an unused buf to recycle: the oldest on probation,
+// or the least recently used hot one. Returns it with its
+// bucket's lock held, and the bucket in *bkp, or 0 if every
+// buf is in use. Caller holds bcache.lock.
+static struct buf*
+bvictim(struct bucket **bkp)
+{
+  struct bucket *probbk, *hotbk;
+  struct buf *b, *vprob, *vhot;
+  int i, h;
+
+  // hold the locks of the buckets of the best so far,
+  // so they can't be taken meanwhile.
+  vprob = vhot = 0;
+  probbk = hotbk = 0;
+  for(i = 0; i < NBUCKET; i++){
+    struct bucket *ck = &bcache.bucket[i];
+    int found = 0;
+
+    acquire(&ck->lock);
+    for(h = i; h < NCHAIN; h += NBUCKET){
+      for(b = bcache.chain[h]; b; b = b->next){
+        if(b->refcnt != 0)
+          continue;
+        if(!b->hot && (vprob == 0 || b->lastuse < vprob->lastuse)){
+          if(probbk && probbk != ck && probbk != hotbk)
+            release(&probbk->lock);
+          vprob = b;
+          probbk = ck;
+          found = 1;
+        }
+        if(b->hot && (vhot == 0 || b->lastuse < vhot->lastuse)){
+          if(hotbk && hotbk != ck && hotbk != probbk)
+            release(&hotbk->lock);
+          vhot = b;
+          hotbk = ck;
+          found = 1;
+        }
+      }
+    }
+    if(!found)
+      release(&ck->lock);
   }
+
+  if(vprob && (vhot == 0 || bcache.nprobation > NBUFS() / 4)){
+    if(hotbk && hotbk != probbk)
+      release(&hotbk->lock);
+    // remember what it held, in case it's wanted again soon.
+    bcache.ghost[bcache.ghostnext].dev = vprob->dev;
+    bcache.ghost[bcache.ghostnext].blockno = vprob->blockno;
+    bcache.ghostnext = (bcache.ghostnext + 1) % NGHOST;
+    bcache.nprobation--;
+    *bkp = probbk;
+    return vprob;
+  }
+  if(probbk && probbk != hotbk)
+    release(&probbk->lock);
+  *bkp = hotbk;
+  return vhot;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// For readahead (ra), only allocate: return 0 if the block is
+// cached already, and lock the new buffer before anyone else
+// can find it, so that this never sleeps.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ra)
 {
+  int h = BHASH(dev, blockno);
+  struct bucket *bk = BUCKET(h);
+  struct bucket *victimbk;
   struct buf *b;
 
-  acquire(&bcache.lock);
-
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  acquire(&bk->lock);
+  if((b = bfind(h, dev, blockno)) != 0){
+    if(ra){
+      bdrop(b);
+      release(&bk->lock);
+      return 0;
     }
+    bk->nhit++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // Not cached. Only the recycler adds blocks to chains,
+  // so look once more holding bcache.lock.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bfind(h, dev, blockno)) != 0){
+    if(ra){
+      bdrop(b);
+      release(&bk->lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    bk->nhit++;
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  bk->nmiss++;
+  release(&bk->lock);
+
+  // Use a buf that has never held a block. Grow rather than
+  // recycle, while memory is plentiful.
+  if(bcache.free == 0 && kfreepages() > bcache.hiwat)
+    bgrow();
+  victimbk = 0;
+  if((b = bcache.free) == 0 && (b = bvictim(&victimbk)) == 0){
+    // every buf is in use: grow, however little memory is left.
+    if(bgrow() < 0)
+      panic("bget: no buffers");
+    b = bcache.free;
+  }
+  bunlink(b);
+
+  b->hot = !BUF2Q || ghosthit(dev, blockno);
+  bcache.nprobation += !b->hot;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  bhold(b);
+  // probation is FIFO: only hot bufs' lastuse moves on in brelse().
+  b->lastuse = r_time();
+  // refcnt was 0, so no one holds b->lock. the read's
+  // completion releases it, not this process.
+  if(ra){
+    acquiresleep(&b->lock);
+    disownsleep(&b->lock);
   }
-  panic("bget: no buffers");
+  if(victimbk != bk){
+    if(victimbk)
+      release(&victimbk->lock);
+    acquire(&bk->lock);
+  }
+  blink(&bcache.chain[h], b);
+  release(&bk->lock);
+  release(&bcache.lock);
+  if(!ra)
+    acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,9 +466,9 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    iosched_rw(b, 0);
     b->valid = 1;
   }
   return b;
@@ -108,46 +480,217 @@ bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  iosched_rw(b, 1);
+}
+
+// Wait until the blocks written to dev so far are durable,
+// not just in the disk's write cache.
+void
+bflush(uint dev)
+{
+  virtio_disk_flush();
+}
+
+// Unlock b and drop a reference to it.
+// Note when a hot one was last used, for recycling.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk;
+
+  releasesleep(&b->lock);
+
+  // b can't change chains while we hold a reference.
+  bk = BUCKET(BHASH(b->dev, b->blockno));
+  acquire(&bk->lock);
+  bdrop(b);
+  if (b->refcnt == 0 && b->hot) {
+    // no one is waiting for it.
+    b->lastuse = r_time();
+  }
+  release(&bk->lock);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("brelse");
+  bput(b);
+}
 
-  releasesleep(&b->lock);
+// iosched calls this when a read started by
+// bread_async() has finished.
+static void
+bdone(struct buf *b)
+{
+  b->valid = 1;
+  bput(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+// Start the read of a run of bufs linked through ionext.
+static void
+breadrun(struct buf *head)
+{
+  struct buf *b, *nxt;
+
+  if(iosched_submit(head, 0, bdone) < 0){
+    // the disk is busy enough; bread() will read them.
+    for(b = head; b; b = nxt){
+      nxt = b->ionext;
+      b->ionext = 0;
+      bput(b);
+    }
+  }
+}
+
+// Start reading the n blocks in blocknos into the cache, those
+// that aren't there already, and return without waiting for the
+// disk. Runs of consecutive blocks are read in one request each.
+// The buffers stay locked until their reads have finished.
+void
+bread_async(uint dev, uint *blocknos, int n)
+{
+  struct buf *b, *head = 0, *tail = 0;
+  int i, len = 0;
+
+  for(i = 0; i < n; i++){
+    if((b = bget(dev, blocknos[i], 1)) == 0)
+      continue;
+    if(head && (b->blockno != tail->blockno + 1 || len == MAXIOBLOCKS)){
+      breadrun(head);
+      head = 0;
+    }
+    if(head == 0){
+      head = b;
+      len = 0;
+    } else {
+      tail->ionext = b;
+    }
+    tail = b;
+    len++;
+  }
+  if(head)
+    breadrun(head);
+}
+
+// The end of the run of consecutive blocks in sorted bs[]
+// that starts at bs[start], at most MAXIOBLOCKS long.
+static int
+runend(struct buf **bs, int start, int n)
+{
+  int i;
+
+  for(i = start + 1; i < n && i - start < MAXIOBLOCKS; i++)
+    if(bs[i]->dev != bs[i-1]->dev || bs[i]->blockno != bs[i-1]->blockno + 1)
+      break;
+  return i;
+}
+
+// Write the n locked bufs in bs to disk, as bwrite() would, in
+// as few requests as possible: bs is sorted by block number, and
+// each run of consecutive blocks goes in one request. The
+// requests are all started before any is waited for.
+void
+bwritev(struct buf **bs, int n)
+{
+  struct buf *b;
+  int i, j, start, end;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+
+  // insertion sort; n is at most a transaction's worth.
+  for(i = 1; i < n; i++){
+    b = bs[i];
+    for(j = i; j > 0 && (bs[j-1]->dev > b->dev ||
+        (bs[j-1]->dev == b->dev && bs[j-1]->blockno > b->blockno)); j--)
+      bs[j] = bs[j-1];
+    bs[j] = b;
+  }
+
+  // link the runs and start them. a run that doesn't fit in
+  // the queue is written before moving on.
+  for(start = 0; start < n; start = end){
+    end = runend(bs, start, n);
+    for(i = start; i + 1 < end; i++)
+      bs[i]->ionext = bs[i+1];
+    if(iosched_submit(bs[start], 1, 0) < 0)
+      iosched_rw(bs[start], 1);
+  }
+
+  // wait for them all. a run's head is done when the whole run is.
+  for(start = 0; start < n; start = runend(bs, start, n))
+    iosched_wait(bs[start]);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt++;
-  release(&bcache.lock);
+  struct bucket *bk = BUCKET(BHASH(b->dev, b->blockno));
+
+  acquire(&bk->lock);
+  bhold(b);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
+  struct bucket *bk = BUCKET(BHASH(b->dev, b->blockno));
+
+  acquire(&bk->lock);
+  bdrop(b);
+  release(&bk->lock);
+}
+
+// The number of free pages below which kalloc()
+// should call bcacheshrink().
+int
+bcachelowat(void)
+{
+  return __atomic_load_n(&bcache.lowat, __ATOMIC_RELAXED);
+}
+
+// Set the free-page watermarks to grow the cache above and
+// shrink it below, or leave either if it's -1. Returns -1
+// if that would leave lo above hi.
+int
+bcachewat(int hi, int lo)
+{
   acquire(&bcache.lock);
-  b->refcnt--;
+  if(hi < -1 || lo < -1 || (hi == -1 ? bcache.hiwat : hi) <
+     (lo == -1 ? bcache.lowat : lo)){
+    release(&bcache.lock);
+    return -1;
+  }
+  if(hi != -1)
+    bcache.hiwat = hi;
+  if(lo != -1)
+    __atomic_store_n(&bcache.lowat, lo, __ATOMIC_RELAXED);
   release(&bcache.lock);
+  return 0;
 }
 
+// Write a report of each bucket's lookups into buf, at
+// most sz bytes. Returns the length of the report.
+int
+bcachestats(char *buf, int sz)
+{
+  struct bucket *bk;
+  uint64 nhit = 0, nmiss = 0;
+  int len;
 
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    nhit += bk->nhit;
+    nmiss += bk->nmiss;
+  }
+  len = snprintf(buf, sz, "bcache: %d bufs, %d on probation, %l hits, %l misses\n",
+                 NBUFS(), bcache.nprobation, nhit, nmiss);
+  len += snprintf(buf+len, sz-len, "bcache bucket hits misses contended\n");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    len += snprintf(buf+len, sz-len, "%d %l %l %l\n", (int)(bk - bcache.bucket),
+                    bk->nhit, bk->nmiss, bk->lock.ncontend);
+  }
+  return len;
+}
@@ -5,8 +5,12 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int hot;      // in the 2Q hot set, not on probation
+  uint64 lastuse; // mtime when refcnt last fell to 0, or cached if on probation
+  struct buf **pprev; // hash chain: the pointer to this buf
   struct buf *next;
+  struct buf *ionext; // next block of the same disk request
+  int ioq;      // the iosched queue of its request
   uchar data[BSIZE];
 };
 
@@ -4,20 +4,30 @@ struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct rcuhead;
 struct spinlock;
 struct sleeplock;
+struct rwspinlock;
+struct rwsleeplock;
 struct stat;
 struct superblock;
 struct vm_area_struct;
-struct file;
+struct mm_struct;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            bread_async(uint, uint*, int);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+void            bflush(uint);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bcachestats(char*, int);
+int             bcacheshrink(void);
+int             bcachelowat(void);
+int             bcachewat(int, int);
 
 // console.c
 void            consoleinit(void);
@@ -31,9 +41,11 @@ int             exec(char*, char**);
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
+struct file*    fileget(int);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
+int             filesync(struct file*, int);
 int             filewrite(struct file*, uint64, int n);
 
 // fs.c
@@ -44,8 +56,10 @@ struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
+void            iunlockshared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
@@ -54,6 +68,8 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             truncblocks(void);
+int             writeblocks(uint);
 void            itrunc(struct inode*);
 
 // ramdisk.c
@@ -61,16 +77,34 @@ void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// futex.c
+void            futexinit(void);
+
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+int             kfreepages(void);
 void            kinit(void);
 
+#ifdef LOCKDEP
+// lockdep.c
+void            lockdep_acquire(struct spinlock*);
+void            lockdep_acquired(struct spinlock*);
+void            lockdep_release(struct spinlock*);
+int             lockdepstats(char*, int);
+#endif
+
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
-void            begin_op(void);
+void            log_data(struct buf*);
+void            log_free(uint);
+int             log_freed(uint);
+void            begin_op(int, int);
 void            end_op(void);
+uint64          log_tid(void);
+void            log_wait(uint64);
+int             logstats(char*, int);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -87,10 +121,14 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             clone(uint64, uint64, int, uint64);
 int             growproc(int);
-void            proc_mapstacks(pagetable_t);
+int             proclimit(int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
+struct mm_struct* mmalloc(struct proc *);
+void            mmput(struct mm_struct *, uint64);
+void            tlbshootdown(struct mm_struct *);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
@@ -100,6 +138,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread(void (*)(void), char*);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -107,6 +146,14 @@ int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 
+// rcu.c
+void            rcuinit(void);
+void            rcu_read_lock(void);
+void            rcu_read_unlock(void);
+void            call_rcu(struct rcuhead*, void (*)(void*), void*);
+void            rcu_qs(void);
+void            rcu_poll(void);
+
 // swtch.S
 void            swtch(struct context*, struct context*);
 
@@ -114,14 +161,34 @@ void            swtch(struct context*, struct context*);
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            freelock(struct spinlock*);
+void            initrwlock(struct rwspinlock*, char*);
+void            acquireread(struct rwspinlock*);
+void            releaseread(struct rwspinlock*);
+void            acquirewrite(struct rwspinlock*);
+void            releasewrite(struct rwspinlock*);
+int             holdingwrite(struct rwspinlock*);
+int             lockstats(char*, int, int);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
+void            disownsleep(struct sleeplock*);
+void            freesleeplock(struct sleeplock*);
+int             sleeplockstats(char*, int, int);
+void            initrwsleeplock(struct rwsleeplock*, char*);
+void            acquiresleepread(struct rwsleeplock*);
+void            releasesleepread(struct rwsleeplock*);
+void            acquiresleepwrite(struct rwsleeplock*);
+void            releasesleepwrite(struct rwsleeplock*);
+int             holdingsleepwrite(struct rwsleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
 // string.c
@@ -142,11 +209,16 @@ int             fetchaddr(uint64, uint64*);
 void            syscall();
 
 // trap.c
-extern uint     ticks;
-void            trapinit(void);
 void            trapinithart(void);
-extern struct spinlock tickslock;
 void            usertrapret(void);
+void            sendipi(int);
+
+// timer.c
+void            timerqinit(void);
+uint64          timenow(void);
+void            timerslice(void);
+int             timerintr(void);
+int             sleepuntil(uint64);
 
 // uart.c
 void            uartinit(void);
@@ -167,6 +239,8 @@ uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
+void            uvmunmapshared(struct mm_struct *, uint64, uint64);
+uint64          uvmdeallocshared(struct mm_struct *, uint64, uint64);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
@@ -174,11 +248,12 @@ int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 pte_t *         walk(pagetable_t pagetable, uint64 va, int alloc);
 int             handlepgfault(uint64 va);
+uint64          walkaddrfault(struct mm_struct *, uint64);
 
 // sysproc.c
 void            mmapinit();
-void            unmapall();
-int             vmareacopy(struct proc *parent, struct proc *son);
+void            unmapall(struct mm_struct *);
+int             vmareacopy(struct mm_struct *parent, struct mm_struct *son);
 
 // plic.c
 void            plicinit(void);
@@ -186,10 +261,21 @@ void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// iosched.c
+void            ioschedinit(void);
+int             iosched_submit(struct buf *, int, void (*)(struct buf *));
+void            iosched_wait(struct buf *);
+void            iosched_rw(struct buf *, int);
+int             iosched_pollmode(int);
+int             ioschedstats(char*, int);
+
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_nqueue(void);
+int             virtio_disk_submit(int, struct buf *, int, void (*)(void *), void *);
 void            virtio_disk_intr(void);
+void            virtio_disk_poll(int);
+void            virtio_disk_flush(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -0,0 +1,4 @@
+// diskpoll() modes: how a process waits for the disk.
+#define DISKPOLL_OFF    0 // sleep until the disk interrupts
+#define DISKPOLL_ON     1 // spin for a while first
+#define DISKPOLL_HYBRID 2 // spin only while the disk has been quick
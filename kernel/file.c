@@ -14,15 +14,18 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+// ftable.lock must be held for writing to allocate or free
+// a file; filedup() only needs it for reading, since it
+// increments f->ref atomically.
 struct {
-  struct spinlock lock;
+  struct rwspinlock lock;
   struct file file[NFILE];
 } ftable;
 
 void
 fileinit(void)
 {
-  initlock(&ftable.lock, "ftable");
+  initrwlock(&ftable.lock, "ftable");
 }
 
 // Allocate a file structure.
@@ -31,15 +34,15 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
+  acquirewrite(&ftable.lock);
   for(f = ftable.file; f < ftable.file + NFILE; f++){
     if(f->ref == 0){
       f->ref = 1;
-      release(&ftable.lock);
+      releasewrite(&ftable.lock);
       return f;
     }
   }
-  release(&ftable.lock);
+  releasewrite(&ftable.lock);
   return 0;
 }
 
@@ -47,11 +50,29 @@ filealloc(void)
 struct file*
 filedup(struct file *f)
 {
-  acquire(&ftable.lock);
+  acquireread(&ftable.lock);
   if(f->ref < 1)
     panic("filedup");
-  f->ref++;
-  release(&ftable.lock);
+  __sync_fetch_and_add(&f->ref, 1);
+  releaseread(&ftable.lock);
+  return f;
+}
+
+// Return a new reference to the file open as descriptor fd in
+// the current process, or 0. The caller must fileclose() it: a
+// thread sharing the file table may close fd meanwhile.
+struct file*
+fileget(int fd)
+{
+  struct files_struct *fs = myproc()->files;
+  struct file *f = 0;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  acquire(&fs->lock);
+  if(fs->ofile[fd])
+    f = filedup(fs->ofile[fd]);
+  release(&fs->lock);
   return f;
 }
 
@@ -61,22 +82,22 @@ fileclose(struct file *f)
 {
   struct file ff;
 
-  acquire(&ftable.lock);
+  acquirewrite(&ftable.lock);
   if(f->ref < 1)
     panic("fileclose");
   if(--f->ref > 0){
-    release(&ftable.lock);
+    releasewrite(&ftable.lock);
     return;
   }
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
-  release(&ftable.lock);
+  releasewrite(&ftable.lock);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    begin_op(truncblocks(), 0);
     iput(ff.ip);
     end_op();
   }
@@ -91,16 +112,33 @@ filestat(struct file *f, uint64 addr)
   struct stat st;
   
   if(f->type == FD_INODE || f->type == FD_DEVICE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, &st);
-    iunlock(f->ip);
-    if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    iunlockshared(f->ip);
+    if(copyout(p->mm->pagetable, addr, (char *)&st, sizeof(st)) < 0)
       return -1;
     return 0;
   }
   return -1;
 }
 
+// Wait until f's latest changes are on disk: with data set,
+// just those to its contents, and its size and blocks.
+int
+filesync(struct file *f, int data)
+{
+  uint64 tid;
+
+  if(f->type == FD_INODE || f->type == FD_DEVICE){
+    ilockshared(f->ip);
+    tid = data ? f->ip->dtid : f->ip->tid;
+    iunlockshared(f->ip);
+    log_wait(tid);
+    return 0;
+  }
+  return -1;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -118,6 +156,8 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    // not ilockshared(): the inode lock also serializes
+    // updates of f->off by processes sharing f.
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
@@ -146,20 +186,20 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write at most a transaction's worth of data blocks
+    // at a time, reserving the blocks each piece can touch,
+    // including 1 of slop for non-aligned writes, and the
+    // i-node, indirect block and allocation blocks it can log.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = (DATASIZE-2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_op(writeblocks(n1), (n1 + BSIZE-1)/BSIZE + 1);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -18,8 +18,13 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
-  struct sleeplock lock; // protects everything below here
+  struct inode *hnext; // Next inode in itable.hash chain
+  struct rwsleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ralast;        // last block readi() read, for readahead
+  uint raend;         // blocks before this have been read ahead
+  uint64 tid;         // last transaction to change it
+  uint64 dtid;        // last transaction to change its data
 
   short type;         // copy of disk inode
   short major;
@@ -15,8 +15,8 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
@@ -46,23 +46,30 @@ fsinit(int dev) {
   initlog(dev, &sb);
 }
 
-// Zero a block.
+// Zero a block. A file data block is written in place before
+// its transaction commits, rather than logged.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
   bp = bread(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  if(data)
+    log_data(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Allocate a zeroed disk block; data says whether it will hold
+// file data, rather than metadata. File data is written in
+// place, so it can't go in a block whose freeing hasn't
+// committed yet; metadata is logged, so it can.
 static uint
-balloc(uint dev)
+balloc(uint dev, int data)
 {
   int b, bi, m;
   struct buf *bp;
@@ -72,11 +79,12 @@ balloc(uint dev)
     bp = bread(dev, BBLOCK(b, sb));
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
       m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
+      if((bp->data[bi/8] & m) == 0 &&  // Is block free?
+         (!data || !log_freed(b + bi))){
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
+        bzero(dev, b + bi, data);
         return b + bi;
       }
     }
@@ -85,6 +93,25 @@ balloc(uint dev)
   panic("balloc: out of blocks");
 }
 
+// The most blocks an op can log freeing an inode's contents:
+// the inode's block and the bitmap blocks.
+int
+truncblocks(void)
+{
+  return 1 + sb.size/BPB + 1;
+}
+
+// The most blocks writei() can log writing n bytes of a file:
+// the inode's block, its indirect block, and a bitmap block for
+// each block it allocates, up to all of them.
+int
+writeblocks(uint n)
+{
+  uint nalloc = (n + BSIZE-1)/BSIZE + 1 + 1;  // slop, indirect
+
+  return 2 + min(nalloc, sb.size/BPB + 1);
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -99,6 +126,7 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  log_free(b);  // before balloc() can see the bit clear
   brelse(bp);
 }
 
@@ -160,20 +188,31 @@ bfree(int dev, uint b)
 //
 // Many internal file system functions expect the caller to
 // have locked the inodes involved; this lets callers create
-// multi-step atomic operations.
+// multi-step atomic operations. Code that only reads an inode
+// and its content can use ilockshared() instead, alongside
+// other readers.
 //
 // The itable.lock spin-lock protects the allocation of itable
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// holds, one must hold itable.lock to change any of those fields,
+// or the itable.hash chains. iget() looks entries up without it,
+// under rcu_read_lock(): entries are never freed, only recycled,
+// so it takes a reference only if ip->ref is not zero, and then
+// checks that the entry still holds the inode it was after.
+// ip->ref is always changed atomically.
 //
-// An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// An ip->lock reader-writer sleep-lock protects all ip-> fields
+// other than ref, dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 31
+#define IHASH(dev, inum) (((dev) * 7 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct inode *hash[NIHASH];   // entries ever used, by dev and inum
 } itable;
 
 void
@@ -183,7 +222,7 @@ iinit()
   
   initlock(&itable.lock, "itable");
   for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+    initrwsleeplock(&itable.inode[i].lock, "inode");
   }
 }
 
@@ -234,6 +273,7 @@ iupdate(struct inode *ip)
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
+  ip->tid = log_tid();
 }
 
 // Find the inode with number inum on device dev
@@ -242,31 +282,75 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, *empty, **pp;
+  int n, r;
+
+  // Is the inode already in the table? A recycled entry may
+  // carry the walk into another chain, so give up after
+  // NINODE steps; a miss is checked again under the lock.
+  rcu_read_lock();
+  ip = __atomic_load_n(&itable.hash[IHASH(dev, inum)], __ATOMIC_ACQUIRE);
+  for(n = 0; ip && n < NINODE; n++){
+    if(ip->dev == dev && ip->inum == inum){
+      // take a reference, unless the entry is free.
+      while((r = __atomic_load_n(&ip->ref, __ATOMIC_RELAXED)) > 0 &&
+            !__sync_bool_compare_and_swap(&ip->ref, r, r + 1))
+        ;
+      if(r > 0)
+        break;
+    }
+    ip = __atomic_load_n(&ip->hnext, __ATOMIC_ACQUIRE);
+  }
+  rcu_read_unlock();
+  if(ip && n < NINODE){
+    // the entry may have been recycled just before we took
+    // the reference.
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+    iput(ip);
+  }
 
   acquire(&itable.lock);
-
-  // Is the inode already in the table?
   empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
+  for(ip = itable.hash[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref > 0){
+        __sync_fetch_and_add(&ip->ref, 1);
+        release(&itable.lock);
+        return ip;
+      }
+      empty = ip;    // reuse it, and stay in this chain.
+      break;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
   // Recycle an inode entry.
+  for(ip = &itable.inode[0]; empty == 0 && ip < &itable.inode[NINODE]; ip++){
+    if(ip->ref == 0)
+      empty = ip;
+  }
   if(empty == 0)
     panic("iget: no inodes");
 
   ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
+  if(ip->dev != dev || ip->inum != inum){
+    // move it to its new chain. a reader looking at ip can
+    // still follow ip->hnext, if into the wrong chain.
+    if(ip->inum != 0){
+      for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+        ;
+      __atomic_store_n(pp, ip->hnext, __ATOMIC_RELEASE);
+    }
+    ip->dev = dev;
+    ip->inum = inum;
+    // it may have changed in the running transaction.
+    ip->tid = ip->dtid = log_tid();
+    ip->hnext = itable.hash[IHASH(dev, inum)];
+    __atomic_store_n(&itable.hash[IHASH(dev, inum)], ip, __ATOMIC_RELEASE);
+  }
   ip->valid = 0;
+  // publish dev and inum before ref.
+  __atomic_store_n(&ip->ref, 1, __ATOMIC_RELEASE);
   release(&itable.lock);
 
   return ip;
@@ -277,9 +361,8 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
-  ip->ref++;
-  release(&itable.lock);
+  // the caller's reference keeps ip from being recycled.
+  __sync_fetch_and_add(&ip->ref, 1);
   return ip;
 }
 
@@ -294,7 +377,7 @@ ilock(struct inode *ip)
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
 
-  acquiresleep(&ip->lock);
+  acquiresleepwrite(&ip->lock);
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -307,19 +390,50 @@ ilock(struct inode *ip)
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
     ip->valid = 1;
+    ip->ralast = ip->raend = 0;
     if(ip->type == 0)
       panic("ilock: no type");
   }
 }
 
+// Lock the given inode for reading only, shared with other
+// readers. Reads the inode from disk if necessary.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  acquiresleepread(&ip->lock);
+
+  // only ilock() may read the inode in. valid can't go back
+  // to 0 while we hold a reference.
+  while(ip->valid == 0){
+    releasesleepread(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+    acquiresleepread(&ip->lock);
+  }
+}
+
 // Unlock the given inode.
 void
 iunlock(struct inode *ip)
 {
-  if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
+  if(ip == 0 || !holdingsleepwrite(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
-  releasesleep(&ip->lock);
+  releasesleepwrite(&ip->lock);
+}
+
+// Unlock an inode locked by ilockshared().
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepread(&ip->lock);
 }
 
 // Drop a reference to an in-memory inode.
@@ -338,8 +452,8 @@ iput(struct inode *ip)
     // inode has no links and no other references: truncate and free.
 
     // ip->ref == 1 means no other process can have ip locked,
-    // so this acquiresleep() won't block (or deadlock).
-    acquiresleep(&ip->lock);
+    // so this acquiresleepwrite() won't block (or deadlock).
+    acquiresleepwrite(&ip->lock);
 
     release(&itable.lock);
 
@@ -348,12 +462,12 @@ iput(struct inode *ip)
     iupdate(ip);
     ip->valid = 0;
 
-    releasesleep(&ip->lock);
+    releasesleepwrite(&ip->lock);
 
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  __sync_fetch_and_sub(&ip->ref, 1);
   release(&itable.lock);
 }
 
@@ -379,10 +493,11 @@ bmap(struct inode *ip, uint bn)
 {
   uint addr, *a;
   struct buf *bp;
+  int data = ip->type == T_FILE;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip->dev, data);
     return addr;
   }
   bn -= NDIRECT;
@@ -390,11 +505,11 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT] = addr = balloc(ip->dev, 0);
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+      a[bn] = addr = balloc(ip->dev, data);
       log_write(bp);
     }
     brelse(bp);
@@ -437,7 +552,7 @@ itrunc(struct inode *ip)
 }
 
 // Copy stat information from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, perhaps shared.
 void
 stati(struct inode *ip, struct stat *st)
 {
@@ -448,8 +563,39 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// How many blocks readi() keeps reading ahead of a
+// sequential reader.
+#define RANUM 8
+
+// Called by readi() before it reads block bn of ip. Once
+// reads look sequential, start reading the next RANUM blocks,
+// without waiting, a half window at a time. With ip->lock
+// perhaps shared, ralast and raend are only hints.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  uint bns[RANUM];
+  int n;
+
+  if(bn != ip->ralast && bn != ip->ralast + 1){
+    // a seek: start over.
+    ip->ralast = bn;
+    ip->raend = bn + 1;
+    return;
+  }
+  ip->ralast = bn;
+  if(ip->raend <= bn)
+    ip->raend = bn + 1;
+  if(ip->raend > bn + RANUM/2)
+    return;
+  for(n = 0; n < RANUM && ip->raend < nblocks && ip->raend <= bn + RANUM; ip->raend++)
+    bns[n++] = bmap(ip, ip->raend);
+  bread_async(ip->dev, bns, n);
+}
+
 // Read data from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, perhaps shared.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
@@ -464,6 +610,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    if(ip->type == T_FILE)
+      readahead(ip, off/BSIZE);
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
@@ -501,9 +649,16 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
-    log_write(bp);
+    // a directory's contents are metadata, and go through
+    // the log; a file's are written in place.
+    if(ip->type == T_FILE)
+      log_data(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
+  if(tot > 0)
+    ip->dtid = log_tid();
 
   if(off > ip->size)
     ip->size = off;
@@ -629,28 +784,35 @@ static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
+  struct files_struct *fs;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  else {
+    // another thread may be in chdir().
+    fs = myproc()->files;
+    acquire(&fs->lock);
+    ip = idup(fs->cwd);
+    release(&fs->lock);
+  }
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+    next = dirlookup(ip, name, 0);
+    iunlockshared(ip);
+    iput(ip);
+    if(next == 0)
       return 0;
-    }
-    iunlockput(ip);
     ip = next;
   }
   if(nameiparent){
@@ -24,6 +24,10 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
+// The log's header block lists the home block of each of
+// the log's other blocks, after two ints.
+#define MAXNLOG (BSIZE / sizeof(uint) - 1)
+
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
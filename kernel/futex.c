@@ -0,0 +1,123 @@
+// Futexes: sleep until another thread or process changes a
+// word of user memory. Waiters are keyed by the word's physical
+// address, so processes that map the same page can wait on it
+// at different virtual addresses.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "futex.h"
+
+#define NFUTEXBUCKET 31
+
+struct futexwaiter {
+  uint64 pa;                // physical address waited on
+  int woken;                // set by futexwake()
+  struct futexwaiter *next;
+};
+
+// each bucket's lock protects its list of waiters,
+// and orders a waiter's check of *pa against a waker.
+static struct {
+  struct spinlock lock;
+  struct futexwaiter *head;
+} buckets[NFUTEXBUCKET];
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEXBUCKET; i++)
+    initlock(&buckets[i].lock, "futex");
+}
+
+// Caller holds mm->vmlock, so that pa's page can't be unmapped
+// and freed before *pa is checked; this releases it once the
+// waiter is queued, and pa is no longer read.
+static int
+futexwait(struct mm_struct *mm, uint64 pa, int val)
+{
+  struct futexwaiter w, **pp;
+  struct proc *p = myproc();
+  int i = (pa >> 2) % NFUTEXBUCKET;
+
+  acquire(&buckets[i].lock);
+  if(__atomic_load_n((int*)pa, __ATOMIC_SEQ_CST) != val){
+    release(&buckets[i].lock);
+    releasesleep(&mm->vmlock);
+    return -1;
+  }
+  w.pa = pa;
+  w.woken = 0;
+  w.next = buckets[i].head;
+  buckets[i].head = &w;
+  releasesleep(&mm->vmlock);
+
+  while(!w.woken && !p->killed)
+    sleep(&w, &buckets[i].lock);
+
+  if(!w.woken){
+    for(pp = &buckets[i].head; *pp != &w; pp = &(*pp)->next)
+      ;
+    *pp = w.next;
+  }
+  release(&buckets[i].lock);
+  return w.woken ? 0 : -1;
+}
+
+static int
+futexwake(uint64 pa, int n)
+{
+  struct futexwaiter *w, **pp;
+  int i = (pa >> 2) % NFUTEXBUCKET;
+  int woken = 0;
+
+  acquire(&buckets[i].lock);
+  pp = &buckets[i].head;
+  while((w = *pp) != 0 && woken < n){
+    if(w->pa == pa){
+      *pp = w->next;
+      w->woken = 1;
+      wakeup(w);
+      woken++;
+    } else {
+      pp = &w->next;
+    }
+  }
+  release(&buckets[i].lock);
+  return woken;
+}
+
+uint64
+sys_futex(void)
+{
+  struct mm_struct *mm = myproc()->mm;
+  uint64 addr, pa;
+  int op, val;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0)
+    return -1;
+  if(addr % sizeof(int) != 0)
+    return -1;
+  acquiresleep(&mm->vmlock);
+  if((pa = walkaddrfault(mm, addr)) == 0){
+    releasesleep(&mm->vmlock);
+    return -1;
+  }
+  pa += addr % PGSIZE;
+
+  switch(op){
+  case FUTEX_WAIT:
+    return futexwait(mm, pa, val);
+  case FUTEX_WAKE:
+    // only compares pa; the page isn't read.
+    releasesleep(&mm->vmlock);
+    return futexwake(pa, val);
+  }
+  releasesleep(&mm->vmlock);
+  return -1;
+}
@@ -0,0 +1,436 @@
+// I/O scheduler: the queues of disk requests between the
+// buffer cache and the virtio driver.
+//
+// There is a queue for each of the disk's queues, and a hart
+// queues its requests on the one for its own disk queue, so
+// that harts doing I/O at once don't share a lock.
+//
+// At most IOQDEPTH requests from a queue are at the disk at
+// once; the rest wait, sorted by block number. A new request
+// for the blocks just after, or just before, those of a
+// waiting one, in the same direction and to be finished the
+// same way, is merged into it, up to MAXIOBLOCKS blocks.
+//
+// The next request to go to the disk is the one furthest past
+// its deadline, if any is: RDEADLINE after a read was queued,
+// WDEADLINE after a write, since a process usually waits for
+// a read but not for a write. Otherwise it is the next by
+// block number from where the disk last was, wrapping around
+// at the end (a one-way elevator).
+//
+// A process waiting for its own request can spin, polling the
+// disk, rather than sleep until the interrupt and then wait to
+// be scheduled again; diskpoll() picks how. DISKPOLL_ON spins
+// for up to POLLMAX. DISKPOLL_HYBRID spins only while requests
+// have lately been finishing within POLLMAX, and for twice as
+// long as they have been taking; a slow disk gets slept on.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "diskpoll.h"
+
+#define NIOQ NCPU                 // most queues
+#define NIOREQ 32                 // requests waiting or at the disk, per queue
+#define IOQDEPTH 4                // most requests at the disk at once, per queue
+#define RDEADLINE (MTIMEHZ/20)    // 50 ms
+#define WDEADLINE (MTIMEHZ/2)     // 500 ms
+#define POLLMAX (MTIMEHZ/2000)    // 500 us
+#define NHIST 16
+
+struct ioq;
+
+struct ioreq {
+  struct ioq *q;
+  struct buf *head;       // the blocks, linked through ionext
+  struct buf *tail;
+  int n;
+  int write;
+  void (*done)(struct buf *);  // called on each buf, or 0 to wake sleepers
+  uint64 t0;              // mtime when queued
+  uint64 deadline;
+  struct ioreq *next;     // on q->sorted, q->busy or q->free
+};
+
+struct ioq {
+  struct spinlock lock;
+  struct ioreq req[NIOREQ];
+  struct ioreq *free;
+  struct ioreq *sorted;   // waiting, by first block
+  struct ioreq *busy;     // at the disk
+  int nwait;
+  int nbusy;
+  uint pos;               // the block after the last one sent
+  uint64 avglat;          // moving average of recent latencies
+
+  // statistics, by write for the last three.
+  uint64 nreq;            // requests queued
+  uint64 nmerge;          // of those, merged into another
+  uint64 nlate;           // sent because of their deadline
+  int maxwait;            // most ever waiting
+  uint64 ndone[2];
+  uint64 lat[2];          // total mtime cycles from queued to done
+  uint64 maxlat[2];
+};
+
+static struct {
+  struct ioq q[NIOQ];
+  int nq;                 // the disk's queues, up to NIOQ
+
+  int pollmode;           // DISKPOLL_*
+  uint64 npoll;           // waits that spun
+  uint64 npollhit;        // of those, done while spinning
+  // iosched_wait()s: hist[i] counts those shorter
+  // than 2^i mtime cycles, the last the rest.
+  uint64 hist[NHIST];
+} io;
+
+static void iocomplete(void *);
+
+// Called after virtio_disk_init(), to have as many
+// queues as the disk.
+void
+ioschedinit(void)
+{
+  struct ioq *q;
+  struct ioreq *r;
+
+  io.nq = virtio_disk_nqueue();
+  if(io.nq > NIOQ)
+    io.nq = NIOQ;
+  io.pollmode = DISKPOLL;
+  for(q = io.q; q < &io.q[io.nq]; q++){
+    initlock(&q->lock, "iosched");
+    for(r = q->req; r < q->req + NIOREQ; r++){
+      r->q = q;
+      r->next = q->free;
+      q->free = r;
+    }
+  }
+}
+
+// this hart's queue.
+static struct ioq*
+myioq(void)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+  return &io.q[id % io.nq];
+}
+
+static void
+sortin(struct ioq *q, struct ioreq *r)
+{
+  struct ioreq **pp;
+
+  for(pp = &q->sorted; *pp && (*pp)->head->blockno <= r->head->blockno; pp = &(*pp)->next)
+    ;
+  r->next = *pp;
+  *pp = r;
+}
+
+static void
+unlink(struct ioreq **list, struct ioreq *r)
+{
+  struct ioreq **pp;
+
+  for(pp = list; *pp != r; pp = &(*pp)->next)
+    ;
+  *pp = r->next;
+}
+
+// Add the n blocks from b to tail to a waiting request,
+// if they go just before or after its blocks.
+static int
+merge(struct ioq *q, struct buf *b, struct buf *tail, int n, int write,
+      void (*done)(struct buf *))
+{
+  struct ioreq *r;
+
+  for(r = q->sorted; r; r = r->next){
+    if(r->write != write || r->done != done || r->head->dev != b->dev ||
+       r->n + n > MAXIOBLOCKS)
+      continue;
+    if(r->tail->blockno + 1 == b->blockno){
+      r->tail->ionext = b;
+      r->tail = tail;
+    } else if(tail->blockno + 1 == r->head->blockno){
+      tail->ionext = r->head;
+      r->head = b;
+      unlink(&q->sorted, r);
+      sortin(q, r);
+    } else {
+      continue;
+    }
+    r->n += n;
+    q->nmerge++;
+    return 1;
+  }
+  return 0;
+}
+
+// Send waiting requests to the disk while it has room.
+// Caller holds q->lock.
+static void
+dispatch(struct ioq *q)
+{
+  struct ioreq *r, *pick;
+  uint64 now;
+
+  while(q->sorted && q->nbusy < IOQDEPTH){
+    now = r_time();
+    pick = 0;
+    for(r = q->sorted; r; r = r->next)
+      if(r->deadline <= now && (pick == 0 || r->deadline < pick->deadline))
+        pick = r;
+    if(pick){
+      q->nlate++;
+    } else {
+      for(pick = q->sorted; pick && pick->head->blockno < q->pos; pick = pick->next)
+        ;
+      if(pick == 0)
+        pick = q->sorted;
+    }
+
+    // on q->busy before iocomplete() can look for it.
+    unlink(&q->sorted, pick);
+    pick->next = q->busy;
+    q->busy = pick;
+    if(virtio_disk_submit(q - io.q, pick->head, pick->write, iocomplete, pick) < 0){
+      // out of descriptors: wait for a request at
+      // the disk to finish and dispatch again.
+      unlink(&q->busy, pick);
+      sortin(q, pick);
+      break;
+    }
+    q->nwait--;
+    q->nbusy++;
+    q->pos = pick->tail->blockno + 1;
+  }
+}
+
+// virtio_disk_intr() calls this when the disk has finished
+// request r.
+static void
+iocomplete(void *arg)
+{
+  struct ioreq *r = arg;
+  struct ioq *q = r->q;
+  struct buf *b, *nxt, *head;
+  void (*done)(struct buf *);
+  uint64 t;
+
+  acquire(&q->lock);
+  unlink(&q->busy, r);
+  q->nbusy--;
+
+  t = r_time() - r->t0;
+  q->ndone[r->write]++;
+  q->lat[r->write] += t;
+  if(t > q->maxlat[r->write])
+    q->maxlat[r->write] = t;
+  q->avglat = q->avglat - q->avglat/8 + t/8;
+
+  head = r->head;
+  done = r->done;
+  r->next = q->free;
+  q->free = r;
+  wakeup(&q->free);
+
+  if(done == 0){
+    for(b = head; b; b = nxt){
+      nxt = b->ionext;
+      b->ionext = 0;
+      b->disk = 0;
+      wakeup(b);
+    }
+  }
+  dispatch(q);
+  release(&q->lock);
+
+  if(done){
+    // the bufs are still the requester's.
+    for(b = head; b; b = nxt){
+      nxt = b->ionext;
+      b->ionext = 0;
+      b->disk = 0;
+      done(b);
+    }
+  }
+}
+
+// Queue a request for the blocks that b heads. If there's no
+// free ioreq, sleep for one if canwait, else return -1.
+static int
+queue(struct buf *b, int write, void (*done)(struct buf *), int canwait)
+{
+  struct ioq *q = myioq();
+  struct ioreq *r;
+  struct buf *x, *tail;
+  int n;
+
+  n = 1;
+  for(tail = b; tail->ionext; tail = tail->ionext)
+    n++;
+
+  acquire(&q->lock);
+  if(!merge(q, b, tail, n, write, done)){
+    while((r = q->free) == 0){
+      if(!canwait){
+        release(&q->lock);
+        return -1;
+      }
+      sleep(&q->free, &q->lock);
+    }
+    q->free = r->next;
+    r->head = b;
+    r->tail = tail;
+    r->n = n;
+    r->write = write;
+    r->done = done;
+    r->t0 = r_time();
+    r->deadline = r->t0 + (write ? WDEADLINE : RDEADLINE);
+    sortin(q, r);
+    if(++q->nwait > q->maxwait)
+      q->maxwait = q->nwait;
+  }
+  for(x = b; x; x = x->ionext){
+    x->disk = 1;
+    x->ioq = q - io.q;
+  }
+  q->nreq++;
+  dispatch(q);
+  release(&q->lock);
+  return 0;
+}
+
+// Start reading (write == 0) or writing the blocks that b
+// heads, up to MAXIOBLOCKS consecutive ones linked through
+// ionext, and return without waiting. Once the disk is done,
+// done() is called on each buf, with no locks held; if done
+// is 0, wait with iosched_wait(b) instead. Returns -1, and
+// starts nothing, if the queue is full.
+int
+iosched_submit(struct buf *b, int write, void (*done)(struct buf *))
+{
+  return queue(b, write, done, 0);
+}
+
+// How long a waiter on q should spin before sleeping: the
+// mtime to stop at, or 0 not to spin.
+static uint64
+pollend(struct ioq *q)
+{
+  uint64 avg = __atomic_load_n(&q->avglat, __ATOMIC_RELAXED);
+
+  switch(__atomic_load_n(&io.pollmode, __ATOMIC_RELAXED)){
+  case DISKPOLL_ON:
+    return r_time() + POLLMAX;
+  case DISKPOLL_HYBRID:
+    if(avg < POLLMAX)
+      return r_time() + 2*avg;
+    return 0;
+  }
+  return 0;
+}
+
+// Wait for a request started by iosched_submit(b, write, 0).
+void
+iosched_wait(struct buf *b)
+{
+  struct ioq *q = &io.q[b->ioq];
+  uint64 t, end;
+  int hit, i;
+
+  t = r_time();
+  if((end = pollend(q)) != 0){
+    while(__atomic_load_n(&b->disk, __ATOMIC_ACQUIRE) && r_time() < end)
+      virtio_disk_poll(b->ioq);
+    hit = __atomic_load_n(&b->disk, __ATOMIC_ACQUIRE) == 0;
+    __sync_fetch_and_add(&io.npoll, 1);
+    __sync_fetch_and_add(&io.npollhit, hit);
+  }
+  acquire(&q->lock);
+  while(b->disk)
+    sleep(b, &q->lock);
+  release(&q->lock);
+
+  t = r_time() - t;
+  for(i = 0; i < NHIST - 1 && t >= (1ULL << i); i++)
+    ;
+  __sync_fetch_and_add(&io.hist[i], 1);
+}
+
+// Read or write the blocks that b heads, and wait for the disk.
+void
+iosched_rw(struct buf *b, int write)
+{
+  queue(b, write, 0, 1);
+  iosched_wait(b);
+}
+
+// Set how waiters wait for the disk, if mode isn't -1.
+// Returns the old mode.
+int
+iosched_pollmode(int mode)
+{
+  if(mode != -1 && mode != DISKPOLL_OFF && mode != DISKPOLL_ON &&
+     mode != DISKPOLL_HYBRID)
+    return -1;
+  if(mode == -1)
+    return __atomic_load_n(&io.pollmode, __ATOMIC_RELAXED);
+  return __atomic_exchange_n(&io.pollmode, mode, __ATOMIC_RELAXED);
+}
+
+// Write the queues' statistics into buf, at most sz bytes.
+// Returns the length of the report.
+int
+ioschedstats(char *buf, int sz)
+{
+  struct ioq *q;
+  uint64 nreq = 0, nmerge = 0, nlate = 0;
+  uint64 ndone[2] = {0, 0}, lat[2] = {0, 0}, maxlat[2] = {0, 0};
+  int len, w, nwait = 0, nbusy = 0, maxwait = 0;
+
+  for(q = io.q; q < &io.q[io.nq]; q++){
+    acquire(&q->lock);
+    nwait += q->nwait;
+    nbusy += q->nbusy;
+    nreq += q->nreq;
+    nmerge += q->nmerge;
+    nlate += q->nlate;
+    if(q->maxwait > maxwait)
+      maxwait = q->maxwait;
+    for(w = 0; w < 2; w++){
+      ndone[w] += q->ndone[w];
+      lat[w] += q->lat[w];
+      if(q->maxlat[w] > maxlat[w])
+        maxlat[w] = q->maxlat[w];
+    }
+    release(&q->lock);
+  }
+
+  len = snprintf(buf, sz, "iosched: %d queues, %d waiting, %d at disk, %l requests, %l merged, %l past deadline, at most %d waiting\n",
+                 io.nq, nwait, nbusy, nreq, nmerge, nlate, maxwait);
+  for(w = 0; w < 2; w++){
+    len += snprintf(buf+len, sz-len, "iosched %s: %l done, latency avg %l max %l mtime cycles\n",
+                    w ? "writes" : "reads", ndone[w],
+                    ndone[w] ? lat[w] / ndone[w] : 0, maxlat[w]);
+  }
+  len += snprintf(buf+len, sz-len, "iosched poll: mode %d, %l spun, %l done spinning\n",
+                  io.pollmode, io.npoll, io.npollhit);
+  len += snprintf(buf+len, sz-len, "iosched waits < 2^i mtime cycles, i = 0..%d:", NHIST - 1);
+  for(w = 0; w < NHIST; w++)
+    len += snprintf(buf+len, sz-len, " %l", io.hist[w]);
+  len += snprintf(buf+len, sz-len, "\n");
+  return len;
+}
@@ -21,6 +21,7 @@ struct run {
 struct {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;                // pages on freelist
 } kmem;
 
 void
@@ -59,24 +60,47 @@ kfree(void *pa)
   acquire(&kmem.lock);
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   release(&kmem.lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// When free pages run low, takes some back from
+// the buffer cache.
 void *
 kalloc(void)
 {
   struct run *r;
+  int nfree;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  for(;;){
+    acquire(&kmem.lock);
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+    }
+    nfree = kmem.nfree;
+    release(&kmem.lock);
+
+    if(r == 0 && bcacheshrink() > 0)
+      continue;
+    if(r && nfree < bcachelowat())
+      bcacheshrink();
+    break;
+  }
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// How many pages are free? Only a hint, since
+// others may be allocating and freeing.
+int
+kfreepages(void)
+{
+  return __atomic_load_n(&kmem.nfree, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,229 @@
+// Lock-order validator, built with make LOCKDEP=1.
+//
+// Spinlocks with the same name form a class. Each hart keeps a
+// stack of the spinlocks it holds; acquiring lock B while
+// holding A records that class A comes before class B. If B is
+// already known to come before A, directly or through other
+// classes, the two orders can deadlock against each other, so
+// the acquire panics with the chain, before it spins.
+//
+// Each class also gets a histogram of how long its locks are
+// held: bucket i counts holds of less than 2^i mtime cycles,
+// and the last bucket everything longer.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NCLASS 128
+#define NHIST 16
+
+struct lockclass {
+  char *name;
+  uint64 hist[NHIST];       // hold times
+  uint64 maxhold;           // longest hold
+};
+
+static struct {
+  int lock;                 // a raw test-and-set lock, not tracked
+  int off;                  // stop checking: a report is printing
+  int nclass;
+  struct lockclass class[NCLASS];
+  // before[a][b/8] bit b%8: a was held while b was acquired.
+  uchar before[NCLASS][NCLASS/8];
+} ld;
+
+static void
+ldlock(void)
+{
+  while(__sync_lock_test_and_set(&ld.lock, 1) != 0)
+    ;
+  __sync_synchronize();
+}
+
+static void
+ldunlock(void)
+{
+  __sync_synchronize();
+  __sync_lock_release(&ld.lock);
+}
+
+// Class number of lk, plus one; 0 if the table is full.
+// Caller holds ld.lock.
+static int
+classof(struct spinlock *lk)
+{
+  int i;
+
+  if(lk->class)
+    return lk->class;
+  for(i = 0; i < ld.nclass; i++)
+    if(strncmp(ld.class[i].name, lk->name, 64) == 0)
+      break;
+  if(i == ld.nclass){
+    if(ld.nclass == NCLASS)
+      return 0;
+    ld.class[ld.nclass++].name = lk->name;
+  }
+  lk->class = i + 1;
+  return lk->class;
+}
+
+static int
+isbefore(int a, int b)
+{
+  return ld.before[a][b/8] & (1 << (b%8));
+}
+
+// Is there a path from class a to class b? A breadth-first
+// search, since kernel stacks are too small to recurse.
+// Fills in path[] with the classes on it, from a, and
+// returns its length, or 0 if there's none.
+// Caller holds ld.lock.
+static int
+findpath(int a, int b, int *path)
+{
+  static int queue[NCLASS], from[NCLASS];
+  int head, tail, c, d, n;
+
+  for(c = 0; c < ld.nclass; c++)
+    from[c] = -1;
+  from[a] = a;
+  head = tail = 0;
+  queue[tail++] = a;
+  while(head < tail && from[b] < 0){
+    c = queue[head++];
+    for(d = 0; d < ld.nclass; d++){
+      if(from[d] < 0 && isbefore(c, d)){
+        from[d] = c;
+        queue[tail++] = d;
+      }
+    }
+  }
+  if(from[b] < 0)
+    return 0;
+
+  // walk back from b, then reverse.
+  n = 0;
+  for(c = b; c != a; c = from[c])
+    path[n++] = c;
+  path[n++] = a;
+  for(c = 0; c < n/2; c++){
+    d = path[c];
+    path[c] = path[n-1-c];
+    path[n-1-c] = d;
+  }
+  return n;
+}
+
+static void
+report(struct spinlock *held, struct spinlock *lk, int *path, int n)
+{
+  int i;
+
+  ld.off = 1;
+  ldunlock();
+  printf("lockdep: acquiring %s while holding %s, but earlier:\n",
+         lk->name, held->name);
+  for(i = 0; i + 1 < n; i++)
+    printf("  %s was held while acquiring %s\n",
+           ld.class[path[i]].name, ld.class[path[i+1]].name);
+  panic("lockdep: lock order cycle");
+}
+
+// Called by acquire(), with interrupts off, before
+// it waits for lk.
+void
+lockdep_acquire(struct spinlock *lk)
+{
+  static int path[NCLASS];
+  struct cpu *c = mycpu();
+  int i, a, b, n;
+
+  if(ld.off)
+    goto push;
+  ldlock();
+  if((b = classof(lk)) == 0)
+    goto out;
+  b--;
+  for(i = 0; i < c->nheld && i < NELEM(c->held); i++){
+    if((a = classof(c->held[i])) == 0)
+      continue;
+    a--;
+    if(a == b || isbefore(a, b))
+      continue;
+    // is b already before a?
+    if((n = findpath(b, a, path)) > 0)
+      report(c->held[i], lk, path, n);
+    ld.before[a][b/8] |= 1 << (b%8);
+  }
+out:
+  ldunlock();
+push:
+  if(c->nheld < NELEM(c->held))
+    c->held[c->nheld] = lk;
+  c->nheld++;
+}
+
+// Called by acquire() once it holds lk.
+void
+lockdep_acquired(struct spinlock *lk)
+{
+  lk->t0 = r_time();
+}
+
+// Called by release(), before it lets go of lk.
+void
+lockdep_release(struct spinlock *lk)
+{
+  struct cpu *c = mycpu();
+  struct lockclass *cl;
+  uint64 t;
+  int i, n;
+
+  // locks needn't be released in the order they
+  // were acquired.
+  n = c->nheld < NELEM(c->held) ? c->nheld : NELEM(c->held);
+  for(i = n - 1; i >= 0; i--){
+    if(c->held[i] == lk){
+      for(; i + 1 < n; i++)
+        c->held[i] = c->held[i+1];
+      break;
+    }
+  }
+  c->nheld--;
+
+  if(ld.off || lk->class == 0)
+    return;
+  t = r_time() - lk->t0;
+  cl = &ld.class[lk->class - 1];
+  for(i = 0; i < NHIST - 1 && t >= (1ULL << i); i++)
+    ;
+  __sync_fetch_and_add(&cl->hist[i], 1);
+  if(t > cl->maxhold)
+    cl->maxhold = t;
+}
+
+// Write the hold-time histograms into buf, at most sz
+// bytes. Returns the length of the report.
+int
+lockdepstats(char *buf, int sz)
+{
+  struct lockclass *cl;
+  int len, i;
+
+  len = snprintf(buf, sz, "lockdep: %d classes; holds < 2^i mtime cycles, i = 0..%d\n",
+                 ld.nclass, NHIST - 1);
+  for(cl = ld.class; cl < &ld.class[ld.nclass]; cl++){
+    len += snprintf(buf+len, sz-len, "%s max %l:", cl->name, cl->maxhold);
+    for(i = 0; i < NHIST; i++)
+      len += snprintf(buf+len, sz-len, " %l", cl->hist[i]);
+    len += snprintf(buf+len, sz-len, "\n");
+  }
+  return len;
+}
@@ -2,8 +2,10 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 
@@ -16,190 +18,685 @@
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op() is told the most blocks the
+// call can log, and reserves room for them in the running
+// transaction; usually it just adds them to the reservations
+// of the in-progress FS system calls and returns. But if they
+// might not fit, it sleeps until the last outstanding end_op()
+// commits.
+//
+// Transactions are double-buffered: once the last op of one
+// has ended, its blocks are copied out of the cache (while
+// begin_op() waits, briefly), and it is written from the
+// copies while new ops join the next one. Whoever commits
+// keeps committing the next transaction too, if its ops have
+// all ended meanwhile. Without LOGASYNC, if recent transactions
+// have had more than one op, the last op to end waits COMMITDELAY
+// first, for more ops to join.
+//
+// With LOGASYNC, the last op to end only seals the transaction,
+// and returns; a kernel thread commits it, and ops join the next
+// transaction while it does, so there is no COMMITDELAY. fsync() waits for a
+// file's last transaction to be durable.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
+//   header block, containing the first live slot, the number
+//     of live slots, and the block # of each: A, B, C, ...
+//   a ring of slots, holding block A, B, C, ... from the first
 // Log appends are synchronous.
+//
+// The log's size is set by mkfs, in the superblock. A
+// transaction may log up to a third of the ring's slots.
+//
+// Committing only appends a transaction's blocks to the ring
+// and rewrites the header. The blocks are installed at their
+// home locations later, all at once, when the ring or the set
+// of blocks waiting to be installed would overflow; a block
+// committed again meanwhile is installed just once, with its
+// latest contents.
+//
+// The disk may keep written blocks in a volatile cache, and
+// write them out in any order, so the log flushes it at the
+// points where order matters: the log blocks must be durable
+// before the header that commits them, the header before the
+// blocks are installed, and the installed blocks before the
+// header is erased and their slots reused.
+//
+// File data isn't logged (ordered mode): writei() hands a file's
+// data blocks to log_data(), and commit() writes them in place,
+// along with the log blocks, before the header that commits the
+// metadata pointing at them. So a committed inode never points
+// at a block whose contents didn't reach the disk, though after
+// a crash an overwrite may be only partly there. Nor may a block
+// freed by a transaction that hasn't committed be written over
+// as file data: after a crash, the block may still be in use,
+// maybe as an indirect block. bfree() tells the log with
+// log_free(), and balloc() passes over such blocks for file
+// data while log_freed() says they are still uncommitted;
+// log_data() panics if one gets through.
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+#define COMMITDELAY (MTIMEHZ/1000)  // 1 ms; only without LOGASYNC
+#define LOGSLOTS (MAXNLOG - 1)      // most slots a header can list
+#define TXNMAX (LOGSLOTS/3)         // most blocks a transaction can log
+#define NLOGHASH 64
+#define NFREEPG 4                   // freeset pages, for 4*PGSIZE*8 blocks
+
+// The block #s of a transaction's logged blocks, kept in memory
+// until it commits.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[TXNMAX];
+};
+
+// Contents of the on-disk header block: n live slots of the
+// ring, from slot tail, and the home block # of each.
+struct logring {
+  int tail;
+  int n;
+  int block[LOGSLOTS];
+};
+
+// Finds a block # in an array of them, for absorption. Chains
+// run through next[], parallel to the array; head[] and next[]
+// hold indexes plus one, and 0 ends a chain. Entries are only
+// removed all at once, by hclear().
+struct blkhash {
+  short head[NLOGHASH];
+  short next[LOGSLOTS];
+};
+
+// The blocks a transaction has freed, one bit each.
+struct freeset {
+  int n;                // bits set
+  char *pg[NFREEPG];
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int nslot;       // slots in the ring, after the header
+  int txnmax;      // most blocks a transaction may log
+  int nfreepg;     // pages in each freeset
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // most blocks they may still log
+  int dreserved;   // and file data blocks they may write
+  int committing;  // in commit(), writing log.clh.
+  int sealing;     // copying log.clh's blocks; begin_op() waits.
+  int delaying;    // an end_op() is waiting for ops to join log.lh.
+  uint64 tid;      // the running transaction's number, from 1
+  uint64 durable;  // the last one committed
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the running transaction
+  struct blkhash lhash;
+  int ndata;            // file data blocks it has written
+  int data[DATASIZE];
+  struct blkhash dhash;
+  int nops;             // ops that have joined it
+  int lastnops;         // ops in the last one committed
+  struct freeset freed; // blocks it has freed
+
+  // the committing transaction, the contents of its blocks
+  // when it was sealed, and the cached bufs they came from.
+  uint64 ctid;
+  uint64 sealtime;
+  struct logheader clh;
+  struct buf *cbuf[TXNMAX];
+  struct buf *cached[TXNMAX];
+  int cndata;
+  int cdata[DATASIZE];
+  struct buf *dbuf[DATASIZE];
+  struct buf *dcached[DATASIZE];
+  struct freeset cfreed;
+
+  // the live part of the ring, and the blocks committed but not
+  // yet installed, with their latest committed contents and the
+  // cached bufs they keep pinned. only the committer uses these,
+  // and log.ninstall and log.nabsorb.
+  int tail;
+  int nlive;
+  int slot[LOGSLOTS];   // home block # of each slot
+  int nckpt;
+  int ckmax;            // twice log.txnmax
+  int ckblock[2*TXNMAX];
+  struct blkhash ckhash;
+  struct buf *ckbuf[2*TXNMAX];
+  struct buf *ckcached[2*TXNMAX];
+
+  // statistics
+  uint64 ncommit;
+  uint64 nblock;        // blocks committed
+  uint64 ndatablock;    // file data blocks written with them
+  uint64 nop;           // ops committed
+  int maxblock;         // most blocks in one commit
+  uint64 lat;           // total mtime cycles from seal to done
+  uint64 maxlat;
+  uint64 ninstall;      // times the ring was installed and freed
+  uint64 nabsorb;       // blocks committed while still uninstalled
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logthread(void);
+
+// Index of block b in block[], or -1.
+static int
+hfind(struct blkhash *h, int *block, int b)
+{
+  int i;
+
+  for (i = h->head[b % NLOGHASH]; i; i = h->next[i-1])
+    if (block[i-1] == b)
+      return i-1;
+  return -1;
+}
+
+// Block b is now at block[i].
+static void
+hadd(struct blkhash *h, int b, int i)
+{
+  h->next[i] = h->head[b % NLOGHASH];
+  h->head[b % NLOGHASH] = i+1;
+}
+
+static void
+hclear(struct blkhash *h)
+{
+  memset(h->head, 0, sizeof(h->head));
+}
+
+// Is block b's bit in fs set? If not, and set is 1, set it.
+static int
+fsbit(struct freeset *fs, uint b, int set)
+{
+  char *p = &fs->pg[b / (PGSIZE*8)][(b / 8) % PGSIZE];
+  int m = 1 << (b % 8);
+
+  if (*p & m)
+    return 1;
+  if (set) {
+    *p |= m;
+    fs->n++;
+  }
+  return 0;
+}
+
+static void
+fsclear(struct freeset *fs)
+{
+  int i;
+
+  if (fs->n == 0)
+    return;
+  for (i = 0; i < log.nfreepg; i++)
+    memset(fs->pg[i], 0, PGSIZE);
+  fs->n = 0;
+}
+
+static void
+allocfreeset(struct freeset *fs)
+{
+  int i;
+
+  for (i = 0; i < log.nfreepg; i++) {
+    if ((fs->pg[i] = kalloc()) == 0)
+      panic("initlog: out of memory");
+    memset(fs->pg[i], 0, PGSIZE);
+  }
+}
+
+// Fill bs[] with n bufs of the log's own, carved out of pages
+// from kalloc(), to hold copies of blocks.
+static void
+allocbufs(struct buf **bs, int n, char *name)
+{
+  struct buf *pg = 0;
+  int i, per = PGSIZE / sizeof(struct buf);
+
+  for (i = 0; i < n; i++) {
+    if (i % per == 0) {
+      if ((pg = kalloc()) == 0)
+        panic("initlog: out of memory");
+      memset(pg, 0, PGSIZE);
+    }
+    bs[i] = &pg[i % per];
+    initsleeplock(&bs[i]->lock, name);
+    bs[i]->dev = log.dev;
+  }
+}
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logring) > BSIZE)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.nslot = log.size - 1;
+  log.txnmax = log.nslot / 3;
+  log.ckmax = 2 * log.txnmax;
+  if (log.txnmax < 1 || log.nslot > LOGSLOTS)
+    panic("initlog: bad log size");
+  log.nfreepg = (sb->size + PGSIZE*8 - 1) / (PGSIZE*8);
+  if (log.nfreepg > NFREEPG)
+    panic("initlog: file system too big");
   log.dev = dev;
+  allocbufs(log.cbuf, log.txnmax, "log copy");
+  allocbufs(log.dbuf, DATASIZE, "log data copy");
+  allocbufs(log.ckbuf, log.ckmax, "log install");
+  allocfreeset(&log.freed);
+  allocfreeset(&log.cfreed);
   recover_from_log();
+  log.tid = 1;
+  if(LOGASYNC)
+    kthread(logthread, "log");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location,
+// through the cache, after a crash. A block may be in several
+// slots; the last is the latest.
 static void
-install_trans(int recovering)
+recover_trans(void)
 {
-  int tail;
+  // too big for the stack
+  static struct buf *dbufs[LOGSLOTS];
+  static int home[LOGSLOTS];
+  static struct blkhash h;
+  struct buf *lbuf;
+  int k, j, n, slot;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
+  n = 0;
+  hclear(&h);
+  for (k = log.nlive - 1; k >= 0; k--) {
+    slot = (log.tail + k) % log.nslot;
+    if (hfind(&h, home, log.slot[slot]) >= 0)
+      continue;
+    home[n] = log.slot[slot];
+    hadd(&h, home[n], n);
+    lbuf = bread(log.dev, log.start+slot+1); // read log block
+    dbufs[n] = bread(log.dev, log.slot[slot]); // read dst
+    memmove(dbufs[n]->data, lbuf->data, BSIZE);  // copy block to dst
     brelse(lbuf);
-    brelse(dbuf);
+    n++;
   }
+  bwritev(dbufs, n);  // write dsts to disk, in sorted runs
+  for (j = 0; j < n; j++)
+    brelse(dbufs[j]);
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk into the in-memory ring.
 static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct logring *lr = (struct logring *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  if (lr->tail < 0 || lr->tail >= log.nslot || lr->n < 0 || lr->n > log.nslot)
+    panic("read_head: bad log header");
+  log.tail = lr->tail;
+  log.nlive = lr->n;
+  for (i = 0; i < log.nlive; i++) {
+    log.slot[(log.tail + i) % log.nslot] = lr->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the in-memory ring's live part to the log header.
+// Writing one with more slots is the true point at which
+// their transaction commits.
 static void
 write_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct logring *lr = (struct logring *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  lr->tail = log.tail;
+  lr->n = log.nlive;
+  for (i = 0; i < log.nlive; i++) {
+    lr->block[i] = log.slot[(log.tail + i) % log.nslot];
   }
   bwrite(buf);
   brelse(buf);
 }
 
+// Write every committed block to its home location, from the
+// latest committed copy, and free the ring. Called by the
+// committer when the ring or log.ckbuf[] is about to fill.
+static void
+install_trans(void)
+{
+  static struct buf *bs[2*TXNMAX];  // bwritev() sorts it
+  int i;
+
+  for (i = 0; i < log.nckpt; i++) {
+    acquiresleep(&log.ckbuf[i]->lock);
+    bs[i] = log.ckbuf[i];
+  }
+  bwritev(bs, log.nckpt);  // write dsts to disk, in sorted runs
+  bflush(log.dev);
+  for (i = 0; i < log.nckpt; i++) {
+    releasesleep(&log.ckbuf[i]->lock);
+    bunpin(log.ckcached[i]);
+  }
+  log.nckpt = 0;
+  hclear(&log.ckhash);
+  log.tail = (log.tail + log.nlive) % log.nslot;
+  log.nlive = 0;
+  write_head();    // Erase the installed transactions from the log
+  bflush(log.dev); // before their slots are written again
+  log.ninstall++;
+}
+
+// Keep the committing transaction's blocks for install_trans(),
+// over older committed copies of the same blocks, which are
+// absorbed.
+static void
+absorb(void)
+{
+  int i, j, b;
+
+  for (i = 0; i < log.clh.n; i++) {
+    b = log.clh.block[i];
+    if ((j = hfind(&log.ckhash, log.ckblock, b)) >= 0) {
+      bunpin(log.cached[i]);  // the older copy pinned it already
+      log.nabsorb++;
+    } else {
+      j = log.nckpt++;
+      log.ckblock[j] = b;
+      hadd(&log.ckhash, b, j);
+      log.ckbuf[j]->blockno = b;
+      log.ckcached[j] = log.cached[i];
+    }
+    memmove(log.ckbuf[j]->data, log.cbuf[i]->data, BSIZE);
+  }
+}
+
+// Is block b waiting to be installed?
+static int
+uninstalled(int b)
+{
+  return hfind(&log.ckhash, log.ckblock, b) >= 0;
+}
+
 static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  recover_trans(); // if committed, copy from log to disk
+  bflush(log.dev);
+  log.tail = (log.tail + log.nlive) % log.nslot;
+  log.nlive = 0;
   write_head(); // clear the log
+  bflush(log.dev);
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call, with the most
+// blocks it can log, and the most file data blocks it can write.
 void
-begin_op(void)
+begin_op(int nblocks, int ndata)
 {
+  struct proc *p = myproc();
+
+  if(nblocks > log.txnmax || ndata > DATASIZE)
+    panic("begin_op: too big");
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.sealing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + nblocks > log.txnmax ||
+              log.ndata + log.dreserved + ndata > DATASIZE){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += nblocks;
+      log.dreserved += ndata;
+      p->opblocks = nblocks;
+      p->opdata = ndata;
+      log.nops += 1;
       release(&log.lock);
       break;
     }
   }
 }
 
+// Make the running transaction the committing one, copying its
+// blocks out of the cache. Caller holds log.lock, which this
+// drops while it copies.
+static void
+seal(void)
+{
+  struct freeset fs;
+  struct buf *b;
+  int i;
+
+  log.sealtime = r_time();
+  log.committing = 1;
+  log.sealing = 1;
+  log.ctid = log.tid++;
+  log.clh = log.lh;
+  log.lh.n = 0;
+  hclear(&log.lhash);
+  log.cndata = log.ndata;
+  memmove(log.cdata, log.data, log.ndata * sizeof(log.data[0]));
+  log.ndata = 0;
+  hclear(&log.dhash);
+  fs = log.cfreed;     // empty since the last commit
+  log.cfreed = log.freed;
+  log.freed = fs;
+  log.lastnops = log.nops;
+  log.nop += log.nops;
+  log.nops = 0;
+  release(&log.lock);
+
+  // no op is running, and none can start, so the blocks
+  // are as the transaction left them. they're pinned, so
+  // bread() finds them cached.
+  for (i = 0; i < log.clh.n; i++) {
+    b = bread(log.dev, log.clh.block[i]);
+    memmove(log.cbuf[i]->data, b->data, BSIZE);
+    log.cached[i] = b;
+    brelse(b);
+  }
+  for (i = 0; i < log.cndata; i++) {
+    b = bread(log.dev, log.cdata[i]);
+    memmove(log.dbuf[i]->data, b->data, BSIZE);
+    log.dcached[i] = b;
+    brelse(b);
+  }
+
+  acquire(&log.lock);
+  log.sealing = 0;
+  wakeup(&log);
+}
+
+// Write the sealed transaction. Caller holds log.lock,
+// which is dropped while commit() waits for the disk.
+static void
+commit_sealed(void)
+{
+  uint64 t;
+
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  release(&log.lock);
+  commit();
+  acquire(&log.lock);
+
+  log.committing = 0;
+  log.durable = log.ctid;
+  fsclear(&log.cfreed);  // its frees are durable; balloc() may reuse them
+  log.ncommit++;
+  log.nblock += log.clh.n;
+  log.ndatablock += log.cndata;
+  if(log.clh.n > log.maxblock)
+    log.maxblock = log.clh.n;
+  t = r_time() - log.sealtime;
+  log.lat += t;
+  if(t > log.maxlat)
+    log.maxlat = t;
+  wakeup(&log);
+}
+
+// Can the running transaction be sealed?
+static int
+ready(void)
+{
+  return log.outstanding == 0 && !log.committing &&
+         (log.lh.n > 0 || log.ndata > 0);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// and no commit is under way.
 void
 end_op(void)
 {
+  struct proc *p = myproc();
   int do_commit = 0;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  log.reserved -= p->opblocks;
+  log.dreserved -= p->opdata;
+  if(log.outstanding == 0 && !log.committing && !log.delaying &&
+     (log.lh.n > 0 || log.ndata > 0)){
     do_commit = 1;
-    log.committing = 1;
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
     // the amount of reserved space.
     wakeup(&log);
   }
+
+  if(do_commit && LOGASYNC){
+    // logthread() writes it.
+    seal();
+  } else if(do_commit){
+    if(log.lastnops > 1 && log.lh.n < log.txnmax/2 && log.ndata < DATASIZE/2){
+      // others are busy too: let them join.
+      log.delaying = 1;
+      release(&log.lock);
+      sleepuntil(timenow() + COMMITDELAY);
+      acquire(&log.lock);
+      log.delaying = 0;
+    }
+    // if ops joined and are still running, the
+    // last of them to end will commit. if a commit
+    // finishes meanwhile, commit again.
+    while(ready()){
+      seal();
+      commit_sealed();
+    }
+  }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// With LOGASYNC, commits the transactions end_op() seals, and
+// the next one too, if its ops have ended meanwhile.
+static void
+logthread(void)
+{
+  // scheduler() switched here holding p->lock, as for forkret().
+  release(&myproc()->lock);
+
+  acquire(&log.lock);
+  for(;;){
+    if(log.committing && !log.sealing)
+      commit_sealed();
+    else if(ready())
+      seal();
+    else
+      sleep(&log, &log.lock);
+  }
+}
+
+// The number of the running transaction; an op's changes
+// are in it. Reads log.tid without the lock, since it only
+// changes between ops.
+uint64
+log_tid(void)
+{
+  return log.tid;
+}
+
+// Wait until transaction tid, and those before it, are on
+// disk.
+void
+log_wait(uint64 tid)
+{
+  acquire(&log.lock);
+  while(log.durable < tid){
+    if(tid == log.tid && log.lh.n == 0 && log.ndata == 0){
+      // it's running, with nothing in it to wait for.
+      tid--;
+      continue;
+    }
+    sleep(&log, &log.lock);
   }
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Append the committing transaction's blocks to the ring, and
+// write its file data blocks to their home locations.
 static void
 write_log(void)
 {
-  int tail;
+  static struct buf *bs[TXNMAX+DATASIZE];  // one commit at a time
+  int tail, i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    i = (log.tail + log.nlive + tail) % log.nslot;
+    log.cbuf[tail]->blockno = log.start+i+1; // log block
+    bs[tail] = log.cbuf[tail];
+  }
+  for (i = 0; i < log.cndata; i++) {
+    log.dbuf[i]->blockno = log.cdata[i];
+    bs[tail+i] = log.dbuf[i];
   }
+  // the log in one request or two, the data in sorted runs.
+  bwritev(bs, log.clh.n + log.cndata);
+  for (i = 0; i < log.cndata; i++)
+    bunpin(log.dcached[i]);
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
+  int i, full;
+
+  for (i = 0; i < log.clh.n; i++)
+    acquiresleep(&log.cbuf[i]->lock);
+  for (i = 0; i < log.cndata; i++)
+    acquiresleep(&log.dbuf[i]->lock);
+
+  // make room; and a block that was metadata, committed but
+  // not installed, and is now file data must be installed
+  // before the data is written over it.
+  full = log.nlive + log.clh.n > log.nslot || log.nckpt + log.clh.n > log.ckmax;
+  for (i = 0; i < log.cndata && !full; i++)
+    full = uninstalled(log.cdata[i]);
+  if (full)
+    install_trans();
+
+  write_log();     // Write modified blocks from copies to log, data home
+  bflush(log.dev);
+  if (log.clh.n > 0) {
+    for (i = 0; i < log.clh.n; i++)
+      log.slot[(log.tail + log.nlive + i) % log.nslot] = log.clh.block[i];
+    log.nlive += log.clh.n;
     write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    bflush(log.dev);
+    absorb();        // Install later
   }
+  for (i = 0; i < log.clh.n; i++)
+    releasesleep(&log.cbuf[i]->lock);
+  for (i = 0; i < log.cndata; i++)
+    releasesleep(&log.dbuf[i]->lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -217,20 +714,85 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
-      break;
+  // log absorption
+  if (hfind(&log.lhash, log.lh.block, b->blockno) < 0) {
+    // Add new block to log
+    if (log.lh.n >= log.txnmax)
+      panic("too big a transaction");
+    i = log.lh.n++;
+    log.lh.block[i] = b->blockno;
+    hadd(&log.lhash, b->blockno, i);
+    bpin(b);
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  release(&log.lock);
+}
+
+// Caller has modified a file data block b and is done with it.
+// Like log_write(), but the block is written in place when the
+// transaction commits, ahead of the log's header, not logged.
+void
+log_data(struct buf *b)
+{
+  int i;
+
+  acquire(&log.lock);
+  if (log.outstanding < 1)
+    panic("log_data outside of trans");
+  if (fsbit(&log.freed, b->blockno, 0) || fsbit(&log.cfreed, b->blockno, 0))
+    panic("log_data: freed block");
+
+  // absorption
+  if (hfind(&log.dhash, log.data, b->blockno) < 0) {
+    if (log.ndata >= DATASIZE)
+      panic("too much data in a transaction");
+    i = log.ndata++;
+    log.data[i] = b->blockno;
+    hadd(&log.dhash, b->blockno, i);
     bpin(b);
-    log.lh.n++;
   }
   release(&log.lock);
 }
 
+// Block b has been freed by the running transaction.
+void
+log_free(uint b)
+{
+  acquire(&log.lock);
+  if (log.outstanding < 1)
+    panic("log_free outside of trans");
+  fsbit(&log.freed, b, 1);
+  release(&log.lock);
+}
+
+// Was block b freed by a transaction that hasn't committed?
+// If so, it mustn't be written in place yet.
+int
+log_freed(uint b)
+{
+  int r;
+
+  acquire(&log.lock);
+  r = fsbit(&log.freed, b, 0) || fsbit(&log.cfreed, b, 0);
+  release(&log.lock);
+  return r;
+}
+
+// Write the log's statistics into buf, at most sz bytes.
+// Returns the length of the report.
+int
+logstats(char *buf, int sz)
+{
+  int len;
+
+  acquire(&log.lock);
+  len = snprintf(buf, sz, "log: %d slots, %d per transaction, %l commits, %l ops, %l blocks, at most %d blocks, %l data blocks, %l installs, %l absorbed, latency avg %l max %l mtime cycles\n",
+                 log.nslot, log.txnmax,
+                 log.ncommit, log.nop, log.nblock, log.maxblock, log.ndatablock,
+                 log.ninstall, log.nabsorb,
+                 log.ncommit ? log.lat / log.ncommit : 0, log.maxlat);
+  release(&log.lock);
+  return len;
+}
@@ -20,14 +20,17 @@ main()
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
-    trapinit();      // trap vectors
+    rcuinit();       // read-copy-update
+    timerqinit();    // one-shot timers
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    futexinit();     // futex wait queues
     virtio_disk_init(); // emulated hard disk
+    ioschedinit();   // disk request queues
     userinit();      // first user process
     __sync_synchronize();
     started = 1;
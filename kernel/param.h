@@ -1,13 +1,24 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC        64  // default limit on processes; see proclimit()
+#define NPROCMAX   1024  // most processes the limit may be raised to
 #define NCPU          8  // maximum number of CPUs
+#define NTHREAD      16  // maximum threads sharing an address space
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXOPBLOCKS  10  // # of blocks a typical FS op logs
+#define LOGBLOCKS    127 // default size of the on-disk log; mkfs -l sets it
+#define DATASIZE     128 // max file data blocks in a transaction
+#define LOGASYNC     1   // end_op() doesn't wait for the commit; see fsync()
+#define NBUF         (MAXOPBLOCKS*3)  // bufs the disk block cache always has
+#define BUFHIWAT     1024  // grow the block cache while more pages are free
+#define BUFLOWAT     256   // shrink it when fewer are; boot-time, see bcachewat()
+#define BUFMAXPG     1024  // most pages of bufs the block cache may grow by
+#define BUF2Q        1     // scan-resistant block cache replacement; 0 for LRU
+#define MAXIOBLOCKS  30    // most blocks moved by one disk request
+#define DISKPOLL     2     // boot-time diskpoll() mode; see diskpoll.h
+#define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define TICKHZ       10    // clock ticks per second, for sleep() and uptime()
@@ -3,22 +3,94 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
+#include "sched.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// procs are allocated on demand and never freed. proc[]
+// lists every one allocated so far, for scheduler() and
+// friends to scan; entries are only ever appended.
+struct proc *proc[NPROCMAX];
+int nproc;
+
+// Fixed-size objects carved out of kalloc()ed pages, for the
+// per-process structures. Freed objects are kept for reuse
+// rather than returned to kalloc(). The caller locks.
+struct pool {
+  uint size;
+  char *page;      // unused rest of the newest page
+  uint left;       // bytes left at page
+  void *free;      // freed objects, linked through their first word
+};
+
+static void*
+poolalloc(struct pool *pl)
+{
+  void *o;
+
+  if((o = pl->free) != 0){
+    pl->free = *(void**)o;
+    return o;
+  }
+  if(pl->left < pl->size){
+    if((pl->page = kalloc()) == 0)
+      return 0;
+    pl->left = PGSIZE;
+  }
+  o = pl->page;
+  pl->page += pl->size;
+  pl->left -= pl->size;
+  return o;
+}
+
+static void
+poolfree(struct pool *pl, void *o)
+{
+  *(void**)o = pl->free;
+  pl->free = o;
+}
+
+struct {
+  struct spinlock lock;
+  struct pool pool;
+} mmtable = { .pool = { sizeof(struct mm_struct) } };
+
+struct {
+  struct spinlock lock;
+  struct pool pool;
+} filestable = { .pool = { sizeof(struct files_struct) } };
 
 struct proc *initproc;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// live procs by pid, so that kill() need not scan proc[].
+// pid_lock serializes changes; findproc() reads the chains
+// without it, under rcu_read_lock().
+#define NPIDHASH 61
+struct proc *pidhash[NPIDHASH];
+
+// stack of UNUSED procs, so that allocproc() need not scan
+// proc[], and the runtime limit on how many may be in use.
+struct {
+  struct spinlock lock;
+  struct proc *slot[NPROCMAX];
+  int n;
+  int nused;                   // procs handed out by allocproc()
+  int max;                     // limit on nused; see proclimit()
+  struct pool pool;
+} freeprocs = { .max = NPROC, .pool = { sizeof(struct proc) } };
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void kickidle(void);
 
 extern char trampoline[]; // trampoline.S
+extern pagetable_t kernel_pagetable; // vm.c
 
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
@@ -26,34 +98,73 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl) {
+// Allocate a new proc, and a page for its kernel stack.
+// Map the stack high in memory, followed by an invalid
+// guard page, and push the proc onto freeprocs.
+// Caller must hold freeprocs.lock.
+static int
+newproc(void)
+{
   struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+  char *pa;
+
+  if(nproc == NPROCMAX)
+    return -1;
+  if((p = poolalloc(&freeprocs.pool)) == 0)
+    return -1;
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  p->kstack = KSTACK(nproc);
+  if((pa = kalloc()) == 0){
+    poolfree(&freeprocs.pool, p);
+    return -1;
+  }
+  // freeprocs.lock serializes changes to the kernel page table.
+  if(mappages(kernel_pagetable, p->kstack, PGSIZE, (uint64)pa, PTE_R | PTE_W) != 0){
+    kfree(pa);
+    poolfree(&freeprocs.pool, p);
+    return -1;
+  }
+  sfence_vma();
+
+  proc[nproc] = p;
+  __sync_synchronize();
+  nproc++;
+  freeprocs.slot[freeprocs.n++] = p;
+  return 0;
+}
+
+// Set the limit on how many procs may exist at once to n,
+// if n is positive. Returns the old limit, or -1 if n is
+// more than NPROCMAX or less than the number of procs in use.
+int
+proclimit(int n)
+{
+  int old;
+
+  if(n > NPROCMAX)
+    return -1;
+  acquire(&freeprocs.lock);
+  if(n > 0 && n < freeprocs.nused){
+    release(&freeprocs.lock);
+    return -1;
   }
+  old = freeprocs.max;
+  if(n > 0)
+    freeprocs.max = n;
+  release(&freeprocs.lock);
+  return old;
 }
 
 // initialize the proc table at boot time.
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  initlock(&mmtable.lock, "mmtable");
+  initlock(&filestable.lock, "filestable");
+  initlock(&freeprocs.lock, "freeprocs");
 }
 
 // Must be called with interrupts disabled,
@@ -85,39 +196,267 @@ myproc(void) {
   return p;
 }
 
-int
-allocpid() {
-  int pid;
-  
+// Give p a new pid, and enter it in pidhash.
+static void
+allocpid(struct proc *p) {
+  struct proc **h;
+
   acquire(&pid_lock);
-  pid = nextpid;
+  p->pid = nextpid;
   nextpid = nextpid + 1;
+  h = &pidhash[p->pid % NPIDHASH];
+  p->pidnext = *h;
+  __atomic_store_n(h, p, __ATOMIC_RELEASE);
   release(&pid_lock);
+}
 
-  return pid;
+// Remove p from pidhash. p->pidnext is left alone, since
+// findproc() may be looking at p; freeproc() doesn't let p be
+// reused, and put back in a chain, until it can't be.
+static void
+freepid(struct proc *p) {
+  struct proc **pp;
+
+  acquire(&pid_lock);
+  for(pp = &pidhash[p->pid % NPIDHASH]; *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      __atomic_store_n(pp, p->pidnext, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+  release(&pid_lock);
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// Look up a live proc by pid, without pid_lock.
+// Returns it with p->lock held, or 0 if there is none.
 static struct proc*
-allocproc(void)
+findproc(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  rcu_read_lock();
+  for(p = __atomic_load_n(&pidhash[pid % NPIDHASH], __ATOMIC_ACQUIRE); p;
+      p = __atomic_load_n(&p->pidnext, __ATOMIC_ACQUIRE)){
+    if(p->pid == pid)
+      break;
+  }
+  if(p == 0){
+    rcu_read_unlock();
+    return 0;
   }
+
+  // p may have been freed since it was found, though not
+  // reused; pids are never reused, so checking the pid is enough.
+  acquire(&p->lock);
+  rcu_read_unlock();
+  if(p->pid != pid || p->state == UNUSED){
+    release(&p->lock);
+    return 0;
+  }
+  return p;
+}
+
+// call_rcu() callback: p is no longer in any reader's
+// hands, so allocproc() may have it.
+static void
+freeprocdone(void *arg)
+{
+  struct proc *p = arg;
+
+  acquire(&freeprocs.lock);
+  freeprocs.slot[freeprocs.n++] = p;
+  release(&freeprocs.lock);
+}
+
+// Allocate an address space for p, with a fresh user page table
+// that maps the trampoline and p->trapframe at TRAPFRAME.
+// Returns 0 if out of memory.
+struct mm_struct*
+mmalloc(struct proc *p)
+{
+  struct mm_struct *mm;
+
+  acquire(&mmtable.lock);
+  if((mm = poolalloc(&mmtable.pool)) == 0){
+    release(&mmtable.lock);
+    return 0;
+  }
+  memset(mm, 0, sizeof(*mm));
+  mm->ref = 1;
+  mm->tfslots = 1;
+  mm->threads[0] = p;
+  release(&mmtable.lock);
+
+  initsleeplock(&mm->vmlock, "vmlock");
+  if((mm->pagetable = proc_pagetable(p)) == 0){
+    acquire(&mmtable.lock);
+    poolfree(&mmtable.pool, mm);
+    release(&mmtable.lock);
+    return 0;
+  }
+  return mm;
+}
+
+// Add p as another thread of mm: give it a free trapframe
+// slot in the shared page table, and take a reference.
+// Returns -1 if mm already has NTHREAD threads or out of memory.
+static int
+mmjoin(struct proc *p, struct mm_struct *mm)
+{
+  int i;
+
+  acquire(&mmtable.lock);
+  for(i = 0; i < NTHREAD; i++){
+    if((mm->tfslots & (1 << i)) == 0)
+      break;
+  }
+  if(i == NTHREAD){
+    release(&mmtable.lock);
+    return -1;
+  }
+  mm->tfslots |= (1 << i);
+  mm->threads[i] = p;
+  mm->ref++;
+  release(&mmtable.lock);
+
+  // the trapframe slots share one page-table page with the
+  // trampoline, so this never allocates, and it does not race
+  // with other threads changing user memory.
+  p->tfva = TRAPFRAME_SLOT(i);
+  if(mappages(mm->pagetable, p->tfva, PGSIZE,
+              (uint64)(p->trapframe), PTE_R | PTE_W) < 0)
+    panic("mmjoin");
   return 0;
+}
+
+// Drop a thread's reference to mm, unmapping the trapframe
+// it had at tfva. The last reference writes back and unmaps
+// every VMA and frees the page table and user memory.
+void
+mmput(struct mm_struct *mm, uint64 tfva)
+{
+  uvmunmap(mm->pagetable, tfva, 1, 0);
+
+  int i = (TRAPFRAME - tfva) / PGSIZE;
+
+  acquire(&mmtable.lock);
+  mm->tfslots &= ~(1 << i);
+  mm->threads[i] = 0;
+  if(mm->ref > 1){
+    mm->ref--;
+    release(&mmtable.lock);
+    return;
+  }
+  release(&mmtable.lock);
+
+  // no other thread can see mm any more.
+  unmapall(mm);
+  uvmunmap(mm->pagetable, TRAMPOLINE, 1, 0);
+  uvmfree(mm->pagetable, mm->sz);
+  mm->pagetable = 0;
+  mm->sz = 0;
+
+  acquire(&mmtable.lock);
+  mm->ref = 0;
+  poolfree(&mmtable.pool, mm);
+  release(&mmtable.lock);
+}
+
+// Allocate an empty file table.
+// Returns 0 if out of memory.
+static struct files_struct*
+filesalloc(void)
+{
+  struct files_struct *fs;
+
+  acquire(&filestable.lock);
+  fs = poolalloc(&filestable.pool);
+  release(&filestable.lock);
+  if(fs == 0)
+    return 0;
+  memset(fs, 0, sizeof(*fs));
+  fs->ref = 1;
+  initlock(&fs->lock, "files");
+  return fs;
+}
+
+// Copy a file table for fork(): the child gets
+// its own table referring to the same files.
+// Returns 0 if out of memory.
+static struct files_struct*
+filescopy(struct files_struct *old)
+{
+  struct files_struct *fs;
+
+  if((fs = filesalloc()) == 0)
+    return 0;
+  acquire(&old->lock);
+  for(int i = 0; i < NOFILE; i++)
+    if(old->ofile[i])
+      fs->ofile[i] = filedup(old->ofile[i]);
+  fs->cwd = idup(old->cwd);
+  release(&old->lock);
+  return fs;
+}
+
+// Drop a reference to a file table. The last reference
+// closes all open files and releases the current directory.
+static void
+filesput(struct files_struct *fs)
+{
+  acquire(&filestable.lock);
+  if(fs->ref > 1){
+    fs->ref--;
+    release(&filestable.lock);
+    return;
+  }
+  release(&filestable.lock);
+
+  for(int fd = 0; fd < NOFILE; fd++){
+    if(fs->ofile[fd]){
+      struct file *f = fs->ofile[fd];
+      fileclose(f);
+      fs->ofile[fd] = 0;
+    }
+  }
+
+  begin_op(truncblocks(), 0);
+  iput(fs->cwd);
+  end_op();
+  fs->cwd = 0;
+
+  acquire(&filestable.lock);
+  fs->ref = 0;
+  poolfree(&filestable.pool, fs);
+  release(&filestable.lock);
+}
+
+// Take an UNUSED proc from freeprocs, allocating a new one
+// if there are none. Initialize state required to run in the
+// kernel, and return with p->lock held.
+// The new proc gets a fresh address space, or joins mm
+// as another thread if mm is non-zero.
+// If the proc limit has been reached, or a memory allocation
+// fails, return 0.
+static struct proc*
+allocproc(struct mm_struct *mm)
+{
+  struct proc *p;
 
-found:
-  p->pid = allocpid();
+  acquire(&freeprocs.lock);
+  if(freeprocs.nused >= freeprocs.max ||
+     (freeprocs.n == 0 && newproc() < 0)){
+    release(&freeprocs.lock);
+    return 0;
+  }
+  p = freeprocs.slot[--freeprocs.n];
+  freeprocs.nused++;
+  release(&freeprocs.lock);
+
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("allocproc");
+  allocpid(p);
   p->state = USED;
 
   // Allocate a trapframe page.
@@ -127,16 +466,23 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
+  // An empty user page table, or a slot in a shared one.
+  if(mm == 0){
+    if((p->mm = mmalloc(p)) == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->tfva = TRAPFRAME;
+  } else {
+    if(mmjoin(p, mm) < 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->mm = mm;
   }
 
-  p->mmap = 0;
-
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -152,20 +498,34 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  // exit() has already let go of the address space,
+  // unless allocproc(), fork() or clone() failed.
+  if(p->mm)
+    mmput(p->mm, p->tfva);
+  p->mm = 0;
+  p->tfva = 0;
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
+  if(p->pid)
+    freepid(p);
   p->pid = 0;
   p->parent = 0;
+  p->children = 0;
+  p->sibling = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+
+  acquire(&freeprocs.lock);
+  freeprocs.nused--;
+  release(&freeprocs.lock);
+
+  // findproc() may still be walking p->pidnext; allocproc()
+  // would move p to another pid chain.
+  call_rcu(&p->rcu, freeprocdone, p);
 }
 
 // Create a user page table for a given process,
@@ -229,43 +589,64 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy init's instructions
   // and data into it.
-  uvminit(p->pagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  uvminit(p->mm->pagetable, initcode, sizeof(initcode));
+  p->mm->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
   p->trapframe->sp = PGSIZE;  // user stack pointer
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
-  p->cwd = namei("/");
+  if((p->files = filesalloc()) == 0)
+    panic("userinit");
+  p->files->cwd = namei("/");
 
   p->state = RUNNABLE;
 
   release(&p->lock);
 }
 
+// Start a kernel thread running fn(), which must not return.
+// It has an empty address space and no files or parent, and
+// starts out holding its p->lock, as forkret() does.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc(0)) == 0)
+    panic("kthread");
+  p->context.ra = (uint64)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
-  struct proc *p = myproc();
+  uint64 sz;
+  struct mm_struct *mm = myproc()->mm;
 
-  sz = p->sz;
+  acquiresleep(&mm->vmlock);
+  sz = mm->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if((sz = uvmalloc(mm->pagetable, sz, sz + n)) == 0) {
+      releasesleep(&mm->vmlock);
       return -1;
     }
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    sz = uvmdeallocshared(mm, sz, sz + n);
   }
-  p->sz = sz;
+  mm->sz = sz;
+  releasesleep(&mm->vmlock);
   return 0;
 }
 
@@ -274,24 +655,31 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *p = myproc();
 
+  // Keep other threads from changing memory while it's copied.
+  // Taken first, since it may sleep and allocproc() returns
+  // holding np->lock.
+  acquiresleep(&p->mm->vmlock);
+
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
+    releasesleep(&p->mm->vmlock);
     return -1;
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->mm->pagetable, np->mm->pagetable, p->mm->sz) < 0){
     freeproc(np);
     release(&np->lock);
+    releasesleep(&p->mm->vmlock);
     return -1;
   }
-  np->sz = p->sz;
+  np->mm->sz = p->mm->sz;
 
-  vmareacopy(p, np);
+  vmareacopy(p->mm, np->mm);
   
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -300,28 +688,124 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+  if((np->files = filescopy(p->files)) == 0){
+    freeproc(np);
+    release(&np->lock);
+    releasesleep(&p->mm->vmlock);
+    return -1;
+  }
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
   release(&np->lock);
+  releasesleep(&p->mm->vmlock);
 
   acquire(&wait_lock);
   np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
   release(&wait_lock);
 
   acquire(&np->lock);
   np->state = RUNNABLE;
   release(&np->lock);
+  kickidle();
 
   return pid;
 }
 
+// Create a new thread running fn(arg) on the given user stack,
+// sharing the caller's address space, and its open files and
+// current directory too if flags has CLONE_FILES.
+// The thread is an ordinary child: it ends with exit(), and
+// the caller collects it with wait(). fn must not return.
+int
+clone(uint64 fn, uint64 stack, int flags, uint64 arg)
+{
+  int pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((flags & CLONE_VM) == 0 || stack == 0 || stack % 16 != 0)
+    return -1;
+
+  // Allocate a thread in p's address space.
+  if((np = allocproc(p->mm)) == 0){
+    return -1;
+  }
+
+  // start at fn(arg), on the new stack.
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack;
+  np->trapframe->a0 = arg;
+
+  if(flags & CLONE_FILES){
+    acquire(&filestable.lock);
+    p->files->ref++;
+    release(&filestable.lock);
+    np->files = p->files;
+  } else if((np->files = filescopy(p->files)) == 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+  kickidle();
+
+  return pid;
+}
+
+// Make sure no other hart still has TLB entries for mm, after
+// the caller has cleared some of its PTEs: interrupt every hart
+// that is running one of mm's threads, and wait for each to
+// flush. The caller must not hold any spinlock, since a hart
+// can only take the interrupt with interrupts enabled.
+void
+tlbshootdown(struct mm_struct *mm)
+{
+  struct cpu *c;
+  struct proc *p;
+  int targets[NCPU];
+
+  // the cleared PTEs must be visible before the flushes.
+  __sync_synchronize();
+
+  push_off();
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    targets[c - cpus] = 0;
+    p = c->proc;
+    if(c != mycpu() && p != 0 && p->mm == mm){
+      __sync_lock_test_and_set(&c->tlbflush, 1);
+      sendipi(c - cpus);
+      targets[c - cpus] = 1;
+    }
+  }
+  pop_off();
+
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    while(targets[c - cpus] && __sync_add_and_fetch(&c->tlbflush, 0) != 0)
+      ;
+  }
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -329,12 +813,15 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  if(p->children == 0)
+    return;
+  while((pp = p->children) != 0){
+    p->children = pp->sibling;
+    pp->parent = initproc;
+    pp->sibling = initproc->children;
+    initproc->children = pp;
   }
+  wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -344,25 +831,22 @@ void
 exit(int status)
 {
   struct proc *p = myproc();
+  struct mm_struct *mm;
 
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
-  }
+  // Close all open files, unless other threads share them.
+  filesput(p->files);
+  p->files = 0;
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
-
-  unmapall();
+  // Let go of user memory, unless other threads share it.
+  // kill() relies on p->mm staying valid while p->lock is held.
+  acquire(&p->lock);
+  mm = p->mm;
+  p->mm = 0;
+  release(&p->lock);
+  mmput(mm, p->tfva);
 
   acquire(&wait_lock);
 
@@ -389,41 +873,38 @@ exit(int status)
 int
 wait(uint64 addr)
 {
-  struct proc *np;
-  int havekids, pid;
+  struct proc *np, **pp;
+  int pid;
   struct proc *p = myproc();
 
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      if(np->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&np->lock);
-
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(np);
+    // Scan through p's children looking for exited ones.
+    for(pp = &p->children; (np = *pp) != 0; pp = &np->sibling){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&np->lock);
+
+      if(np->state == ZOMBIE){
+        // Found one.
+        pid = np->pid;
+        if(addr != 0 && copyout(p->mm->pagetable, addr, (char *)&np->xstate,
+                                sizeof(np->xstate)) < 0) {
           release(&np->lock);
           release(&wait_lock);
-          return pid;
+          return -1;
         }
+        *pp = np->sibling;
+        freeproc(np);
         release(&np->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&np->lock);
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || p->killed){
+    if(p->children == 0 || p->killed){
       release(&wait_lock);
       return -1;
     }
@@ -433,6 +914,33 @@ wait(uint64 addr)
   }
 }
 
+// Is any proc RUNNABLE? A hint only, since it
+// looks without locks.
+static int
+anyrunnable(void)
+{
+  for(int i = 0; i < nproc; i++)
+    if(proc[i]->state == RUNNABLE)
+      return 1;
+  return 0;
+}
+
+// A proc has just become RUNNABLE: get an idle hart,
+// if there is one, out of wfi in scheduler() to run it.
+static void
+kickidle(void)
+{
+  struct cpu *c;
+
+  __sync_synchronize();
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(c->idle && __sync_lock_test_and_set(&c->idle, 0)){
+      sendipi(c - cpus);
+      return;
+    }
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -445,28 +953,56 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int found;
   
   c->proc = 0;
+  c->online = 1;
   for(;;){
+    rcu_poll();
+
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
+    found = 0;
+    for(int i = 0; i < nproc; i++) {
+      p = proc[i];
       acquire(&p->lock);
       if(p->state == RUNNABLE) {
+        // a hart may cache invalid PTEs, so make sure this one
+        // sees the kernel stacks newproc() has mapped since.
+        if(c->nproc != nproc){
+          c->nproc = nproc;
+          sfence_vma();
+        }
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
         p->state = RUNNING;
         c->proc = p;
+        timerslice();
         swtch(&c->context, &p->context);
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
         c->proc = 0;
+        c->slice = 0;
+        found = 1;
       }
       release(&p->lock);
     }
+
+    if(!found){
+      // Nothing to run, and no time slice to end: wait for
+      // an interrupt. With interrupts off, one that arrives
+      // after the check still ends the wfi; kickidle()
+      // interrupts this hart when another makes a proc RUNNABLE.
+      intr_off();
+      c->idle = 1;
+      __sync_synchronize();
+      if(!anyrunnable())
+        asm volatile("wfi");
+      c->idle = 0;
+    }
   }
 }
 
@@ -492,6 +1028,7 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+  rcu_qs();
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
@@ -566,40 +1103,61 @@ void
 wakeup(void *chan)
 {
   struct proc *p;
+  int woken = 0;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for(int i = 0; i < nproc; i++) {
+    p = proc[i];
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
         p->state = RUNNABLE;
+        woken = 1;
       }
       release(&p->lock);
     }
   }
+  if(woken)
+    kickidle();
 }
 
-// Kill the process with the given pid.
-// The victim won't exit until it tries to return
+// Kill the process with the given pid, along with
+// any threads that share its address space.
+// The victims won't exit until they try to return
 // to user space (see usertrap() in trap.c).
 int
 kill(int pid)
 {
   struct proc *p;
+  int pids[NTHREAD], n = 0;
+
+  if((p = findproc(pid)) == 0)
+    return -1;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    p->state = RUNNABLE;
+  }
+  // p->lock keeps p->mm from going away; a zombie has none.
+  if(p->mm){
+    acquire(&mmtable.lock);
+    for(int i = 0; i < NTHREAD; i++){
+      if(p->mm->threads[i] && p->mm->threads[i] != p)
+        pids[n++] = p->mm->threads[i]->pid;
+    }
+    release(&mmtable.lock);
+  }
+  release(&p->lock);
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
+  for(int i = 0; i < n; i++){
+    if((p = findproc(pids[i])) != 0){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
+      if(p->state == SLEEPING)
         p->state = RUNNABLE;
-      }
       release(&p->lock);
-      return 0;
     }
-    release(&p->lock);
   }
-  return -1;
+  kickidle();
+  return 0;
 }
 
 // Copy to either a user address, or kernel address,
@@ -610,7 +1168,7 @@ either_copyout(int user_dst, uint64 dst, void *src, uint64 len)
 {
   struct proc *p = myproc();
   if(user_dst){
-    return copyout(p->pagetable, dst, src, len);
+    return copyout(p->mm->pagetable, dst, src, len);
   } else {
     memmove((char *)dst, src, len);
     return 0;
@@ -625,7 +1183,7 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
 {
   struct proc *p = myproc();
   if(user_src){
-    return copyin(p->pagetable, dst, src, len);
+    return copyin(p->mm->pagetable, dst, src, len);
   } else {
     memmove(dst, (char*)src, len);
     return 0;
@@ -649,7 +1207,8 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(int i = 0; i < nproc; i++){
+    p = proc[i];
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -18,12 +18,29 @@ struct context {
   uint64 s11;
 };
 
+// A callback queued by call_rcu().
+struct rcuhead {
+  struct rcuhead *next;
+  void (*fn)(void*);
+  void *arg;
+};
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int tlbflush;               // Another hart asked us to flush our TLB.
+  int nproc;                  // Kernel stacks the TLB has been flushed for.
+  uint64 slice;               // mtime when proc's time slice ends, or 0.
+  int idle;                   // Waiting in scheduler() for work; see kickidle().
+  int online;                 // Has entered scheduler().
+  uint64 rcuqs;               // Quiescent states passed; see rcu.c.
+#ifdef LOCKDEP
+  struct spinlock *held[16];  // Spinlocks held, in acquire order.
+  int nheld;                  // May exceed NELEM(held).
+#endif
 };
 
 extern struct cpu cpus[NCPU];
@@ -96,6 +113,31 @@ struct vm_area_struct {
   int used;
 };
 
+// A user address space. Shared by all the threads that
+// a process creates with clone(CLONE_VM).
+struct mm_struct {
+  int ref;                     // Procs using it; mmtable.lock
+  uint tfslots;                // Trapframe slots in use; mmtable.lock
+  struct proc *threads[NTHREAD]; // Procs by trapframe slot; mmtable.lock
+
+  // vmlock must be held when changing these, or the page table,
+  // while other threads might be running:
+  struct sleeplock vmlock;
+  pagetable_t pagetable;       // User page table
+  uint64 sz;                   // Size of process memory (bytes)
+  struct vm_area_struct *mmap; // List of VMAs
+  uint64 maxva;
+};
+
+// Open files and current directory. Shared by all the threads
+// that a process creates with clone(CLONE_FILES).
+struct files_struct {
+  int ref;                     // Procs using it; filestable.lock
+  struct spinlock lock;        // protects ofile[]
+  struct file *ofile[NOFILE];  // Open files
+  struct inode *cwd;           // Current directory
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -107,19 +149,24 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
-  // wait_lock must be held when using this:
+  // pid_lock must be held to change this; findproc() reads it
+  // under rcu_read_lock().
+  struct proc *pidnext;        // Next proc in pid hash chain
+  struct rcuhead rcu;          // Defers reuse until readers are done
+
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *children;       // Most recently created child
+  struct proc *sibling;        // Next child of the same parent
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  struct mm_struct *mm;        // User address space
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 tfva;                 // where trapframe is mapped in mm
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  struct files_struct *files;  // Open files and current directory
+  int opblocks;                // log blocks its FS op reserved
+  int opdata;                  // and file data blocks
   char name[16];               // Process name (debugging)
-
-  struct vm_area_struct *mmap; // List of VMAs
-  uint64 maxva;
 };
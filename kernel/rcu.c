@@ -0,0 +1,129 @@
+// Read-copy-update: lookups that take no locks.
+//
+// A reader brackets its walk of a shared structure with
+// rcu_read_lock() and rcu_read_unlock(), which just disable
+// interrupts, so the reader can't be switched out; it must not
+// sleep. A writer unlinks an element under its own lock and
+// hands it to call_rcu(), which calls back once every hart has
+// passed through a quiescent state (a context switch, a return
+// to user space, or idling in the scheduler), when no reader can
+// still be looking at the element.
+//
+// Each hart counts its quiescent states in c->rcuqs. A grace
+// period starts by snapshotting the counts, and ends when every
+// hart's count has moved on, or the hart is idle. Callbacks
+// queue on rcu.next until a grace period starts, then wait on
+// rcu.wait for it to end. scheduler() drives this from
+// rcu_poll(), as do timer interrupts, so that a hart that is
+// busy running one process still retires callbacks.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+static struct {
+  struct spinlock lock;
+  struct rcuhead *next;     // waiting for a grace period to start
+  struct rcuhead *wait;     // waiting for the current one to end
+  uint64 snap[NCPU];        // c->rcuqs when the current one started
+} rcu;
+
+void
+rcuinit(void)
+{
+  initlock(&rcu.lock, "rcu");
+}
+
+void
+rcu_read_lock(void)
+{
+  push_off();
+}
+
+void
+rcu_read_unlock(void)
+{
+  pop_off();
+}
+
+// Call fn(arg) once no reader can be using what's been
+// unlinked. fn runs from rcu_poll(), holding no spinlocks.
+void
+call_rcu(struct rcuhead *h, void (*fn)(void*), void *arg)
+{
+  h->fn = fn;
+  h->arg = arg;
+  acquire(&rcu.lock);
+  h->next = rcu.next;
+  rcu.next = h;
+  release(&rcu.lock);
+}
+
+// This hart holds no references from a read-side section.
+// Interrupts must be off.
+void
+rcu_qs(void)
+{
+  struct cpu *c = mycpu();
+
+  __atomic_store_n(&c->rcuqs, c->rcuqs + 1, __ATOMIC_RELEASE);
+}
+
+// Has every hart passed a quiescent state since the
+// current grace period started? Caller holds rcu.lock.
+static int
+gpdone(void)
+{
+  struct cpu *c;
+
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(!c->online || __atomic_load_n(&c->idle, __ATOMIC_ACQUIRE))
+      continue;
+    if(__atomic_load_n(&c->rcuqs, __ATOMIC_ACQUIRE) == rcu.snap[c - cpus])
+      return 0;
+  }
+  return 1;
+}
+
+// Called by scheduler(), and by usertrap() and kerneltrap()
+// on a timer interrupt, all quiescent states, to end the
+// current grace period if it can, start the next one, and
+// run the callbacks whose grace period has ended.
+void
+rcu_poll(void)
+{
+  struct rcuhead *done = 0, *h;
+  struct cpu *c;
+
+  push_off();
+  rcu_qs();
+  pop_off();
+
+  // cheap check without the lock for the common case.
+  if(__atomic_load_n(&rcu.next, __ATOMIC_RELAXED) == 0 &&
+     __atomic_load_n(&rcu.wait, __ATOMIC_RELAXED) == 0)
+    return;
+
+  acquire(&rcu.lock);
+  if(rcu.wait && gpdone()){
+    done = rcu.wait;
+    rcu.wait = 0;
+  }
+  if(rcu.wait == 0 && rcu.next){
+    rcu.wait = rcu.next;
+    rcu.next = 0;
+    for(c = cpus; c < &cpus[NCPU]; c++)
+      rcu.snap[c - cpus] = __atomic_load_n(&c->rcuqs, __ATOMIC_ACQUIRE);
+  }
+  release(&rcu.lock);
+
+  while((h = done) != 0){
+    done = h->next;
+    h->fn(h->arg);
+  }
+}
@@ -0,0 +1,3 @@
+// clone() flags.
+#define CLONE_VM        0x100 // share the address space (required)
+#define CLONE_FILES     0x400 // share open files and current directory
@@ -6,8 +6,27 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
+
+// How long acquiresleep() spins for a running holder
+// before it gives up and sleeps, in mtime cycles.
+#define SPINTIME (MTIMEHZ / 20000)
+
+// every initialized sleep lock, for sleeplockstats().
+#define NSLEEPLOCK 1024
+static struct sleeplock *sleeplocks[NSLEEPLOCK];
+static int nsleeplock;
+static struct spinlock sleeplockslock = { .name = "sleeplocks" };
+
+// Is lk in sleeplocks[]? As with spinlocks, lk->slot may be
+// stale, so check that the slot points back.
+// Caller must hold sleeplockslock.
+static int
+listed(struct sleeplock *lk)
+{
+  return lk->slot > 0 && lk->slot <= nsleeplock && sleeplocks[lk->slot - 1] == lk;
+}
 
 void
 initsleeplock(struct sleeplock *lk, char *name)
@@ -15,18 +34,85 @@ initsleeplock(struct sleeplock *lk, char *name)
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->owner = 0;
+  lk->nwait = 0;
   lk->pid = 0;
+  lk->nacquire = 0;
+  lk->nspin = 0;
+  lk->nsleep = 0;
+
+  // locks in reused memory are initialized again.
+  acquire(&sleeplockslock);
+  if(!listed(lk)){
+    lk->slot = 0;
+    if(nsleeplock < NSLEEPLOCK){
+      sleeplocks[nsleeplock++] = lk;
+      lk->slot = nsleeplock;
+    }
+  }
+  release(&sleeplockslock);
 }
 
+// Forget about lk, whose memory is about to be freed.
+void
+freesleeplock(struct sleeplock *lk)
+{
+  acquire(&sleeplockslock);
+  if(listed(lk)){
+    sleeplocks[lk->slot - 1] = sleeplocks[--nsleeplock];
+    sleeplocks[lk->slot - 1]->slot = lk->slot;
+    lk->slot = 0;
+  }
+  release(&sleeplockslock);
+  freelock(&lk->lk);
+}
+
+// Is the holder of lk running on another hart? Only a hint:
+// it's read without the holder's p->lock, but procs are never
+// freed, so owner always points to a proc.
+static int
+ownerrunning(struct sleeplock *lk)
+{
+  struct proc *owner = __atomic_load_n(&lk->owner, __ATOMIC_RELAXED);
+
+  return owner && __atomic_load_n(&owner->state, __ATOMIC_RELAXED) == RUNNING;
+}
+
+// Acquire lk. While the holder is running on another hart it
+// will likely release lk soon, so spin for a while, instead of
+// paying for a sleep and wakeup; sleep once the holder blocks
+// or SPINTIME has passed.
 void
 acquiresleep(struct sleeplock *lk)
 {
+  uint64 t0 = 0;
+  int slept = 0;
+
   acquire(&lk->lk);
   while (lk->locked) {
+    if(t0 == 0)
+      t0 = r_time();
+    if(!slept && ownerrunning(lk) && r_time() - t0 < SPINTIME){
+      release(&lk->lk);
+      while(__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) && ownerrunning(lk) &&
+            r_time() - t0 < SPINTIME)
+        ;
+      acquire(&lk->lk);
+      continue;
+    }
+    slept = 1;
+    lk->nwait++;
     sleep(lk, &lk->lk);
+    lk->nwait--;
   }
   lk->locked = 1;
+  lk->owner = myproc();
   lk->pid = myproc()->pid;
+  lk->nacquire++;
+  if(slept)
+    lk->nsleep++;
+  else if(t0)
+    lk->nspin++;
   release(&lk->lk);
 }
 
@@ -35,8 +121,25 @@ releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
   lk->locked = 0;
+  lk->owner = 0;
+  lk->pid = 0;
+  // spinning waiters see locked go to 0; only
+  // sleepers need the scan of the proc table.
+  if(lk->nwait)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+// Leave lk locked, but held by no process: for a lock that
+// an interrupt handler will release. Waiters then sleep
+// rather than spin on a caller that has moved on, and
+// holdingsleep() is false for the caller.
+void
+disownsleep(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->owner = 0;
   lk->pid = 0;
-  wakeup(lk);
   release(&lk->lk);
 }
 
@@ -51,5 +154,119 @@ holdingsleep(struct sleeplock *lk)
   return r;
 }
 
+// Write a report of the n sleep locks that were waited for
+// most often into buf, at most sz bytes. Returns the length
+// of the report.
+int
+sleeplockstats(char *buf, int sz, int n)
+{
+  struct sleeplock *lk, *prev = 0;
+  uint64 nacquire = 0, nspin = 0, nsleep = 0;
+  int len, i;
+
+  acquire(&sleeplockslock);
+  for(i = 0; i < nsleeplock; i++){
+    nacquire += sleeplocks[i]->nacquire;
+    nspin += sleeplocks[i]->nspin;
+    nsleep += sleeplocks[i]->nsleep;
+  }
+  len = snprintf(buf, sz, "%d sleep locks, %l acquires, %l spun, %l slept\n",
+                 nsleeplock, nacquire, nspin, nsleep);
+  len += snprintf(buf+len, sz-len, "name acquires spun slept\n");
+
+  // same selection sort as lockstats(), by nspin + nsleep.
+  for(; n > 0; n--){
+    lk = 0;
+    for(i = 0; i < nsleeplock; i++){
+      uint64 w = sleeplocks[i]->nspin + sleeplocks[i]->nsleep;
+      if(w == 0)
+        continue;
+      if(prev && (w > prev->nspin + prev->nsleep ||
+                  (w == prev->nspin + prev->nsleep && sleeplocks[i] >= prev)))
+        continue;
+      if(lk == 0 || w > lk->nspin + lk->nsleep ||
+         (w == lk->nspin + lk->nsleep && sleeplocks[i] > lk))
+        lk = sleeplocks[i];
+    }
+    if(lk == 0)
+      break;
+    len += snprintf(buf+len, sz-len, "%s %l %l %l\n",
+                    lk->name, lk->nacquire, lk->nspin, lk->nsleep);
+    prev = lk;
+  }
+  release(&sleeplockslock);
+  return len;
+}
+
+
 
 
+void
+initrwsleeplock(struct rwsleeplock *lk, char *name)
+{
+  initlock(&lk->lk, "rw sleep lock");
+  lk->name = name;
+  lk->readers = 0;
+  lk->writer = 0;
+  lk->wwait = 0;
+  lk->pid = 0;
+}
+
+// Acquire lk for reading, alongside other readers.
+void
+acquiresleepread(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  while (lk->writer || lk->wwait) {
+    sleep(lk, &lk->lk);
+  }
+  lk->readers++;
+  release(&lk->lk);
+}
+
+void
+releasesleepread(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->readers < 1)
+    panic("releasesleepread");
+  if(--lk->readers == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+// Acquire lk for writing, excluding everyone else.
+void
+acquiresleepwrite(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->wwait++;
+  while (lk->writer || lk->readers) {
+    sleep(lk, &lk->lk);
+  }
+  lk->wwait--;
+  lk->writer = 1;
+  lk->pid = myproc()->pid;
+  release(&lk->lk);
+}
+
+void
+releasesleepwrite(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->writer = 0;
+  lk->pid = 0;
+  wakeup(lk);
+  release(&lk->lk);
+}
+
+int
+holdingsleepwrite(struct rwsleeplock *lk)
+{
+  int r;
+  
+  acquire(&lk->lk);
+  r = lk->writer && (lk->pid == myproc()->pid);
+  release(&lk->lk);
+  return r;
+}
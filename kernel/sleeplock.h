@@ -2,9 +2,31 @@
 struct sleeplock {
   uint locked;       // Is the lock held?
   struct spinlock lk; // spinlock protecting this sleep lock
+  struct proc *owner; // Process holding lock
+  int nwait;         // Processes sleeping on the lock
   
   // For debugging:
   char *name;        // Name of lock.
   int pid;           // Process holding lock
+
+  // Statistics, for lockstat():
+  uint64 nacquire;   // Times acquired.
+  uint64 nspin;      // Times acquired by spinning, without sleeping.
+  uint64 nsleep;     // Times acquiresleep() had to sleep.
+  int slot;          // Index in sleeplock.c's sleeplocks[], plus one; 0 if not there.
 };
 
+
+// Reader-writer long-term lock: shared by any number of
+// readers, or held by one writer. Waiting writers hold off
+// new readers, so readers can't starve them.
+struct rwsleeplock {
+  struct spinlock lk; // spinlock protecting the fields below
+  int readers;       // Number of readers holding the lock
+  int writer;        // Is the lock held for writing?
+  int wwait;         // Writers waiting for the lock
+
+  // For debugging:
+  char *name;        // Name of lock.
+  int pid;           // Process holding lock for writing
+};
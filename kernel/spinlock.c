@@ -4,33 +4,96 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "riscv.h"
 #include "proc.h"
 #include "defs.h"
 
+// every initialized lock, for lockstats(). not every
+// lock fits; those that don't just aren't reported.
+#define NLOCK 4096
+static struct spinlock *locks[NLOCK];
+static int nlock;
+static struct spinlock lockslock = { .name = "locks" };
+
+// Is lk in locks[]? lk->slot may be left over from whatever
+// last used lk's memory, so check that the slot points back.
+// Caller must hold lockslock.
+static int
+listed(struct spinlock *lk)
+{
+  return lk->slot > 0 && lk->slot <= nlock && locks[lk->slot - 1] == lk;
+}
+
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->serving = 0;
   lk->cpu = 0;
+  lk->nacquire = 0;
+  lk->ncontend = 0;
+  lk->nspin = 0;
+#ifdef LOCKDEP
+  lk->class = 0;
+#endif
+
+  // locks in reused memory are initialized again.
+  acquire(&lockslock);
+  if(!listed(lk)){
+    lk->slot = 0;
+    if(nlock < NLOCK){
+      locks[nlock++] = lk;
+      lk->slot = nlock;
+    }
+  }
+  release(&lockslock);
+}
+
+// Forget about lk, whose memory is about to be freed.
+void
+freelock(struct spinlock *lk)
+{
+  acquire(&lockslock);
+  if(listed(lk)){
+    // move the last lock into lk's slot.
+    locks[lk->slot - 1] = locks[--nlock];
+    locks[lk->slot - 1]->slot = lk->slot;
+    lk->slot = 0;
+  }
+  release(&lockslock);
 }
 
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
+// Waiters get the lock in the order they arrived.
 void
 acquire(struct spinlock *lk)
 {
+  uint ticket;
+  uint64 t0 = 0;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
+#ifdef LOCKDEP
+  lockdep_acquire(lk);
+#endif
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
+  // On RISC-V, __sync_fetch_and_add turns into an atomic add:
   //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  //   s1 = &lk->next
+  //   amoadd.w.aqrl a5, a5, (s1)
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+
+  // Waiters only read lk->serving while they spin, so the
+  // cache line is only written once per hand-off.
+  if(__atomic_load_n(&lk->serving, __ATOMIC_ACQUIRE) != ticket){
+    t0 = r_time();
+    while(__atomic_load_n(&lk->serving, __ATOMIC_ACQUIRE) != ticket)
+      ;
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +103,14 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+  lk->nacquire++;
+  if(t0){
+    lk->ncontend++;
+    lk->nspin += r_time() - t0;
+  }
+#ifdef LOCKDEP
+  lockdep_acquired(lk);
+#endif
 }
 
 // Release the lock.
@@ -48,6 +119,9 @@ release(struct spinlock *lk)
 {
   if(!holding(lk))
     panic("release");
+#ifdef LOCKDEP
+  lockdep_release(lk);
+#endif
 
   lk->cpu = 0;
 
@@ -59,25 +133,94 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Serve the next ticket. Only the holder writes lk->serving,
+  // so this need not be atomic, but it must be a single store;
+  // the C standard implies that an assignment might be
+  // implemented with multiple store instructions.
+  __atomic_store_n(&lk->serving, lk->serving + 1, __ATOMIC_RELEASE);
+
+  pop_off();
+}
+
+void
+initrwlock(struct rwspinlock *lk, char *name)
+{
+  lk->name = name;
+  lk->state = 0;
+  lk->wwait = 0;
+  lk->cpu = 0;
+}
+
+// Acquire the lock for reading, alongside other readers.
+// Waits while a writer holds the lock or is waiting for it.
+void
+acquireread(struct rwspinlock *lk)
+{
+  uint s;
+
+  push_off(); // disable interrupts to avoid deadlock.
+  for(;;){
+    s = __atomic_load_n(&lk->state, __ATOMIC_RELAXED);
+    if((s & RWWRITER) == 0 && __atomic_load_n(&lk->wwait, __ATOMIC_RELAXED) == 0 &&
+       __sync_bool_compare_and_swap(&lk->state, s, s + 1))
+      break;
+  }
+  __sync_synchronize();
+}
+
+void
+releaseread(struct rwspinlock *lk)
+{
+  if(lk->state == 0 || (lk->state & RWWRITER))
+    panic("releaseread");
+  __sync_synchronize();
+  __sync_fetch_and_sub(&lk->state, 1);
+  pop_off();
+}
+
+// Acquire the lock for writing, excluding everyone else.
+void
+acquirewrite(struct rwspinlock *lk)
+{
+  push_off(); // disable interrupts to avoid deadlock.
+  if(holdingwrite(lk))
+    panic("acquirewrite");
 
+  __sync_fetch_and_add(&lk->wwait, 1);
+  while(__atomic_load_n(&lk->state, __ATOMIC_RELAXED) != 0 ||
+        !__sync_bool_compare_and_swap(&lk->state, 0, RWWRITER))
+    ;
+  __sync_fetch_and_sub(&lk->wwait, 1);
+  __sync_synchronize();
+  lk->cpu = mycpu();
+}
+
+void
+releasewrite(struct rwspinlock *lk)
+{
+  if(!holdingwrite(lk))
+    panic("releasewrite");
+  lk->cpu = 0;
+  __sync_synchronize();
+  __atomic_store_n(&lk->state, 0, __ATOMIC_RELEASE);
   pop_off();
 }
 
+// Check whether this cpu is holding lk for writing.
+// Interrupts must be off.
+int
+holdingwrite(struct rwspinlock *lk)
+{
+  return lk->state == RWWRITER && lk->cpu == mycpu();
+}
+
 // Check whether this cpu is holding the lock.
 // Interrupts must be off.
 int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->next != lk->serving && lk->cpu == mycpu());
   return r;
 }
 
@@ -108,3 +251,45 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// Write a report of the n most contended locks into buf,
+// at most sz bytes. Returns the length of the report.
+int
+lockstats(char *buf, int sz, int n)
+{
+  struct spinlock *lk, *prev = 0;
+  uint64 nacquire = 0, ncontend = 0;
+  int len, i;
+
+  acquire(&lockslock);
+  for(i = 0; i < nlock; i++){
+    nacquire += locks[i]->nacquire;
+    ncontend += locks[i]->ncontend;
+  }
+  len = snprintf(buf, sz, "%d locks, %l acquires, %l contended\n",
+                 nlock, nacquire, ncontend);
+  len += snprintf(buf+len, sz-len, "name acquires contended spin\n");
+
+  // selection sort, since n is small: each round finds the
+  // most contended lock that is less contended than prev.
+  for(; n > 0; n--){
+    lk = 0;
+    for(i = 0; i < nlock; i++){
+      if(locks[i]->ncontend == 0)
+        continue;
+      if(prev && (locks[i]->ncontend > prev->ncontend ||
+                  (locks[i]->ncontend == prev->ncontend && locks[i] >= prev)))
+        continue;
+      if(lk == 0 || locks[i]->ncontend > lk->ncontend ||
+         (locks[i]->ncontend == lk->ncontend && locks[i] > lk))
+        lk = locks[i];
+    }
+    if(lk == 0)
+      break;
+    len += snprintf(buf+len, sz-len, "%s %l %l %l\n",
+                    lk->name, lk->nacquire, lk->ncontend, lk->nspin);
+    prev = lk;
+  }
+  release(&lockslock);
+  return len;
+}
@@ -1,9 +1,36 @@
 // Mutual exclusion lock.
+// A ticket lock: each acquire() takes the next ticket,
+// and waits until the lock is serving it.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;         // Next ticket to hand out.
+  uint serving;      // Ticket of the holder; the lock is free if next == serving.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // Statistics, updated by the holder:
+  uint64 nacquire;   // Times acquired.
+  uint64 ncontend;   // Times acquire() had to wait.
+  uint64 nspin;      // Time spent waiting, in mtime cycles.
+  int slot;          // Index in spinlock.c's locks[], plus one; 0 if not there.
+
+#ifdef LOCKDEP
+  int class;         // lockdep class, plus one; 0 if not yet known.
+  uint64 t0;         // mtime when acquired.
+#endif
+};
+
+// Reader-writer spin lock: any number of readers, or one writer.
+// Writers take precedence: once one is waiting, new readers wait
+// too, so a stream of readers can't starve it.
+struct rwspinlock {
+  uint state;        // RWWRITER if write-held, else number of readers.
+  uint wwait;        // Writers waiting.
+
+  // For debugging:
+  char *name;        // Name of lock.
+  struct cpu *cpu;   // The cpu holding the lock for writing.
 };
 
+#define RWWRITER 0x80000000
@@ -0,0 +1,102 @@
+//
+// formatted output to a string.
+//
+
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+static char digits[] = "0123456789abcdef";
+
+static int
+sputc(char *s, char c)
+{
+  *s = c;
+  return 1;
+}
+
+static int
+sprintint(char *s, int end, uint64 x, int base, int sign)
+{
+  char buf[24];
+  int i, n;
+
+  if(sign && (sign = (long)x < 0))
+    x = -x;
+
+  i = 0;
+  do {
+    buf[i++] = digits[x % base];
+  } while((x /= base) != 0);
+
+  if(sign)
+    buf[i++] = '-';
+
+  n = 0;
+  while(--i >= 0 && n < end)
+    n += sputc(s+n, buf[i]);
+  return n;
+}
+
+// Print to buf, at most sz-1 characters, and nul-terminate it.
+// Only understands %d, %x, %p, %s, and %l for a uint64.
+// Returns the number of characters printed, not counting the nul.
+int
+snprintf(char *buf, int sz, char *fmt, ...)
+{
+  va_list ap;
+  int i, c;
+  int off = 0;
+  char *s;
+
+  if(sz <= 0)
+    return 0;
+  sz--;   // room for the nul.
+
+  va_start(ap, fmt);
+  for(i = 0; (c = fmt[i] & 0xff) != 0 && off < sz; i++){
+    if(c != '%'){
+      off += sputc(buf+off, c);
+      continue;
+    }
+    c = fmt[++i] & 0xff;
+    if(c == 0)
+      break;
+    switch(c){
+    case 'd':
+      off += sprintint(buf+off, sz-off, va_arg(ap, int), 10, 1);
+      break;
+    case 'l':
+      off += sprintint(buf+off, sz-off, va_arg(ap, uint64), 10, 0);
+      break;
+    case 'x':
+      off += sprintint(buf+off, sz-off, va_arg(ap, uint), 16, 0);
+      break;
+    case 'p':
+      off += sprintint(buf+off, sz-off, va_arg(ap, uint64), 16, 0);
+      break;
+    case 's':
+      if((s = va_arg(ap, char*)) == 0)
+        s = "(null)";
+      for(; *s && off < sz; s++)
+        off += sputc(buf+off, *s);
+      break;
+    case '%':
+      off += sputc(buf+off, '%');
+      break;
+    default:
+      // Print unknown % sequence to draw attention.
+      off += sputc(buf+off, '%');
+      if(off < sz)
+        off += sputc(buf+off, c);
+      break;
+    }
+  }
+  va_end(ap);
+  buf[off] = 0;
+  return off;
+}
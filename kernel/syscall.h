@@ -21,4 +21,13 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_mmap   22
-#define SYS_munmap  23
\ No newline at end of file
+#define SYS_munmap  23
+#define SYS_clone  24
+#define SYS_futex  25
+#define SYS_proclimit 26
+#define SYS_nanosleep 27
+#define SYS_lockstat 28
+#define SYS_diskpoll 29
+#define SYS_fsync  30
+#define SYS_fdatasync 31
+#define SYS_bcachewat 32
\ No newline at end of file
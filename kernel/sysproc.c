@@ -5,9 +5,9 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
 
@@ -103,31 +103,39 @@ sys_mmap(void)
     return -1;
 
   p = myproc();
-  if(fd < 0 || fd >= NOFILE || (f = p->ofile[fd]) == 0) 
+  if((f = fileget(fd)) == 0)
     return -1;
 
-  if((prot & PROT_WRITE) && (flags & MAP_SHARED) && !f->writable) 
-    return -1;
-  if(((prot & PROT_READ) || (prot & PROT_EXEC)) && !f->readable)
+  if(((prot & PROT_WRITE) && (flags & MAP_SHARED) && !f->writable) ||
+     (((prot & PROT_READ) || (prot & PROT_EXEC)) && !f->readable)){
+    fileclose(f);
     return -1;
+  }
 
-  ilock(f->ip);
-  if(offset >= f->ip->size) 
+  ilockshared(f->ip);
+  if(offset >= f->ip->size) {
+    iunlockshared(f->ip);
+    fileclose(f);
     return -1;
-  iunlock(f->ip);
+  }
+  iunlockshared(f->ip);
 
-  if(p->mmap == 0) {
-    p->maxva = p->sz > STARTADDR ? PGROUNDUP(p->sz) : STARTADDR;
+  struct mm_struct *mm = p->mm;
+  acquiresleep(&mm->vmlock);
+  if(mm->mmap == 0) {
+    mm->maxva = mm->sz > STARTADDR ? PGROUNDUP(mm->sz) : STARTADDR;
   }
 
-  uint64 start = p->maxva;
+  uint64 start = mm->maxva;
   uint64 end = start + length;
   if(end >= CLINT) { // memlayout.h
-    start = p->maxva = 0x20000000;
+    start = mm->maxva = 0x20000000;
     end = start + length;
   }
   
   if(end >= KERNBASE) {
+    releasesleep(&mm->vmlock);
+    fileclose(f);
     printf("mmap out of KERNBASE\n");
     return -1;
   }
@@ -139,29 +147,44 @@ sys_mmap(void)
   vmarea->vm_prot = prot;
   vmarea->vm_flags = flags;
   vmarea->vm_off = offset;
-  vmarea->vm_file = filedup(f);
-  vmarea->vm_next = p->mmap;
-  p->mmap = vmarea;
-  p->maxva = PGROUNDUP(end); 
-  vmmap(p->pagetable, start, end);
+  vmarea->vm_file = f;  // fileget()'s reference
+  vmarea->vm_next = mm->mmap;
+  mm->mmap = vmarea;
+  mm->maxva = PGROUNDUP(end); 
+  vmmap(mm->pagetable, start, end);
+  releasesleep(&mm->vmlock);
   return start;
 }
 
-void writetodisk(struct vm_area_struct *vmarea, uint64 start, uint64 length) {
+// Write [start, start+length) of a MAP_SHARED vmarea in mm back
+// to its file. Copies from mm's page table rather than the current
+// process's, since exec() drops the old mm after switching to the
+// new one. Pages that were never faulted in are skipped.
+void writetodisk(struct mm_struct *mm, struct vm_area_struct *vmarea, uint64 start, uint64 length) {
+  uint64 va, va0, pa, n;
 
   if((vmarea->vm_flags & MAP_PRIVATE) || !(vmarea->vm_prot & PROT_WRITE))
     return;
   
   struct inode *ip = vmarea->vm_file->ip;
-  begin_op();
-  ilock(ip);
-  // TODO: check whether virtual address has been mapped to pa
-  writei(ip, 1, start, vmarea->vm_off + start - vmarea->vm_start, length);
-  iunlock(ip);
-  end_op();
+  for(va = start; va < start + length; va = va0 + PGSIZE) {
+    va0 = PGROUNDDOWN(va);
+    n = PGSIZE - (va - va0);
+    if(n > start + length - va)
+      n = start + length - va;
+    if((pa = walkaddr(mm->pagetable, va0)) == 0)
+      continue;
+    // a page at a time, so that each op's blocks fit in
+    // its share of the transaction.
+    begin_op(writeblocks(n), (n + BSIZE-1)/BSIZE + 1);
+    ilock(ip);
+    writei(ip, 0, pa + (va - va0), vmarea->vm_off + va - vmarea->vm_start, n);
+    iunlock(ip);
+    end_op();
+  }
 }
 
-int vmareacopy(struct proc *parent, struct proc *son) {
+int vmareacopy(struct mm_struct *parent, struct mm_struct *son) {
   struct vm_area_struct *vmarea = parent->mmap, *vma;
 
   while (vmarea) {
@@ -175,19 +198,21 @@ int vmareacopy(struct proc *parent, struct proc *son) {
 
     vmarea = vmarea->vm_next;
   }
+  son->maxva = parent->maxva;
   return 0;
 }
 
-void unmapall() {
-  struct proc *p = myproc();
+// Write back and unmap every VMA of mm.
+// Only called once no thread is using mm any more.
+void unmapall(struct mm_struct *mm) {
   struct vm_area_struct *vmarea;
   uint64 length;
-  while ((vmarea = p->mmap)) {
+  while ((vmarea = mm->mmap)) {
     length = vmarea->vm_end - vmarea->vm_start;
-    writetodisk(vmarea, vmarea->vm_start, length);
-    vmunmap(p->pagetable, vmarea->vm_start, PGROUNDUP(length) / PGSIZE);
+    writetodisk(mm, vmarea, vmarea->vm_start, length);
+    vmunmap(mm->pagetable, vmarea->vm_start, PGROUNDUP(length) / PGSIZE);
+    mm->mmap = mm->mmap->vm_next;
     freevm(vmarea);
-    p->mmap = p->mmap->vm_next;
   }
 }
 
@@ -202,21 +227,25 @@ sys_munmap(void)
   if(addr % PGSIZE)
     return -1;
 
-  struct proc *p = myproc();
+  struct mm_struct *mm = myproc()->mm;
   struct vm_area_struct *vmarea;
 
-  for(vmarea = p->mmap; vmarea; vmarea = vmarea->vm_next) {
+  acquiresleep(&mm->vmlock);
+  for(vmarea = mm->mmap; vmarea; vmarea = vmarea->vm_next) {
     if(addr >= vmarea->vm_start && addr + length <= vmarea->vm_end) {
       break;
     }
   }
-  if(vmarea == 0)
+  if(vmarea == 0) {
+    releasesleep(&mm->vmlock);
     return -1;
+  }
 
-  writetodisk(vmarea, addr, length);
-  vmunmap(p->pagetable, addr, PGROUNDUP(length) / PGSIZE);
+  writetodisk(mm, vmarea, addr, length);
+  // other threads may still have the pages in their TLBs.
+  uvmunmapshared(mm, addr, PGROUNDUP(length) / PGSIZE);
   if(vmarea->vm_start == addr && vmarea->vm_end == addr + length) {
-    struct vm_area_struct **q = &p->mmap;
+    struct vm_area_struct **q = &mm->mmap;
     // delete vmarea
     while(*q && *q != vmarea) {
       q = &(*q)->vm_next;
@@ -233,6 +262,7 @@ sys_munmap(void)
   } else {
     panic("munmap to be done");
   }
+  releasesleep(&mm->vmlock);
   return 0;
 }
 
@@ -258,6 +288,83 @@ sys_fork(void)
   return fork();
 }
 
+uint64
+sys_clone(void)
+{
+  uint64 fn, stack, arg;
+  int flags;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &stack) < 0 ||
+     argint(2, &flags) < 0 || argaddr(3, &arg) < 0)
+    return -1;
+  return clone(fn, stack, flags, arg);
+}
+
+uint64
+sys_proclimit(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  return proclimit(n);
+}
+
+// copy a report of the n most contended spinlocks
+// to buf, at most sz bytes; returns its length.
+uint64
+sys_lockstat(void)
+{
+  int n, sz, len;
+  uint64 buf;
+  char *report;
+
+  if(argint(0, &n) < 0 || argaddr(1, &buf) < 0 || argint(2, &sz) < 0)
+    return -1;
+  if(sz <= 0)
+    return -1;
+  if((report = kalloc()) == 0)
+    return -1;
+  if(sz > PGSIZE)
+    sz = PGSIZE;
+  len = lockstats(report, sz, n);
+  len += sleeplockstats(report + len, sz - len, n);
+  len += bcachestats(report + len, sz - len);
+  len += ioschedstats(report + len, sz - len);
+  len += logstats(report + len, sz - len);
+#ifdef LOCKDEP
+  len += lockdepstats(report + len, sz - len);
+#endif
+  if(copyout(myproc()->mm->pagetable, buf, report, len + 1) < 0)
+    len = -1;
+  kfree(report);
+  return len;
+}
+
+// set how processes wait for the disk, one of the
+// DISKPOLL_ modes, or -1 to leave it; returns the old mode.
+uint64
+sys_diskpoll(void)
+{
+  int mode;
+
+  if(argint(0, &mode) < 0)
+    return -1;
+  return iosched_pollmode(mode);
+}
+
+// set the free-page watermarks above which the block cache
+// grows and below which it shrinks, -1 to leave either.
+uint64
+sys_bcachewat(void)
+{
+  int hi, lo;
+
+  if(argint(0, &hi) < 0 || argint(1, &lo) < 0)
+    return -1;
+  return bcachewat(hi, lo);
+}
+
 uint64
 sys_wait(void)
 {
@@ -275,7 +382,7 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
+  addr = myproc()->mm->sz;
   if(growproc(n) < 0)
     return -1;
   return addr;
@@ -285,21 +392,22 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if(n <= 0)
+    return 0;
+  return sleepuntil(timenow() + (uint64)n * (MTIMEHZ / TICKHZ));
+}
+
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns;
+
+  if(argaddr(0, &ns) < 0)
+    return -1;
+  return sleepuntil(timenow() + ns / (1000000000 / MTIMEHZ));
 }
 
 uint64
@@ -312,15 +420,10 @@ sys_kill(void)
   return kill(pid);
 }
 
-// return how many clock tick interrupts have occurred
+// return how many clock ticks have passed
 // since start.
 uint64
 sys_uptime(void)
 {
-  uint xticks;
-
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+  return timenow() / (MTIMEHZ / TICKHZ);
 }
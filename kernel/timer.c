@@ -0,0 +1,206 @@
+// One-shot timers.
+//
+// Each hart keeps a heap of pending timers, ordered by deadline,
+// and programs its own CLINT_MTIMECMP for the earliest of them or
+// for the end of the running process's time slice, whichever
+// comes first. There is no periodic tick: a hart with nothing to
+// run and no timers pending takes no timer interrupts at all.
+//
+// timervec in kernelvec.S disarms MTIMECMP when it fires, and
+// forwards the interrupt to timerintr() via devintr().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+// length of a time slice, in mtime cycles.
+#define QUANTUM (MTIMEHZ / TICKHZ)
+
+#define NOTIME (~0ULL)
+
+struct timer {
+  uint64 when;       // mtime deadline
+  int fired;         // set by timerintr()
+  int i;             // index in heap[]
+};
+
+// a proc waits on at most one timer, so NPROCMAX is enough.
+struct timerq {
+  struct spinlock lock;
+  struct timer *heap[NPROCMAX]; // min-heap on when
+  int n;
+  uint64 next;       // heap[0]->when, or NOTIME if empty
+} timerqs[NCPU];
+
+void
+timerqinit(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    initlock(&timerqs[i].lock, "timerq");
+    timerqs[i].next = NOTIME;
+  }
+}
+
+// current time, in mtime cycles since boot.
+uint64
+timenow(void)
+{
+  return *(volatile uint64*)CLINT_MTIME;
+}
+
+static void
+heapswap(struct timerq *q, int i, int j)
+{
+  struct timer *t = q->heap[i];
+
+  q->heap[i] = q->heap[j];
+  q->heap[j] = t;
+  q->heap[i]->i = i;
+  q->heap[j]->i = j;
+}
+
+static void
+heapfix(struct timerq *q, int i)
+{
+  int c;
+
+  while(i > 0 && q->heap[i]->when < q->heap[(i-1)/2]->when){
+    heapswap(q, i, (i-1)/2);
+    i = (i-1)/2;
+  }
+  while((c = 2*i + 1) < q->n){
+    if(c + 1 < q->n && q->heap[c+1]->when < q->heap[c]->when)
+      c++;
+    if(q->heap[i]->when <= q->heap[c]->when)
+      break;
+    heapswap(q, i, c);
+    i = c;
+  }
+  q->next = q->n > 0 ? q->heap[0]->when : NOTIME;
+}
+
+static void
+heapinsert(struct timerq *q, struct timer *t)
+{
+  if(q->n == NPROCMAX)
+    panic("heapinsert");
+  t->i = q->n++;
+  q->heap[t->i] = t;
+  heapfix(q, t->i);
+}
+
+static void
+heapremove(struct timerq *q, struct timer *t)
+{
+  int i = t->i;
+
+  q->n--;
+  if(i != q->n){
+    q->heap[i] = q->heap[q->n];
+    q->heap[i]->i = i;
+    heapfix(q, i);
+  } else {
+    q->next = q->n > 0 ? q->heap[0]->when : NOTIME;
+  }
+}
+
+// Program this hart's MTIMECMP for its next deadline.
+// Only a hart writes its own MTIMECMP, always with interrupts
+// off, so the writes never race. q->next is read without
+// q->lock: other harts only ever remove timers, which at worst
+// causes one early interrupt.
+static void
+timerset(void)
+{
+  struct cpu *c = mycpu();
+  uint64 when = timerqs[cpuid()].next;
+
+  if(c->slice && c->slice < when)
+    when = c->slice;
+  *(uint64*)CLINT_MTIMECMP(cpuid()) = when;
+}
+
+// Start a time slice for the process the scheduler is about to
+// run. Called with interrupts off.
+void
+timerslice(void)
+{
+  mycpu()->slice = timenow() + QUANTUM;
+  timerset();
+}
+
+// Handle a timer interrupt on this hart: wake up each sleeper
+// whose deadline has passed, and program the next deadline.
+// Returns 1 if the running process's time slice is over.
+int
+timerintr(void)
+{
+  struct cpu *c;
+  struct timerq *q;
+  struct timer *t;
+  uint64 now;
+  int expired = 0;
+
+  push_off();
+  c = mycpu();
+  q = &timerqs[cpuid()];
+  acquire(&q->lock);
+  now = timenow();
+  while(q->n > 0 && (t = q->heap[0])->when <= now){
+    heapremove(q, t);
+    t->fired = 1;
+    wakeup(t);
+  }
+  if(c->slice && c->slice <= now){
+    c->slice = 0;
+    expired = 1;
+  }
+  timerset();
+  release(&q->lock);
+  pop_off();
+  return expired;
+}
+
+// Sleep until mtime reaches when.
+// Returns 0, or -1 if the process is killed first.
+int
+sleepuntil(uint64 when)
+{
+  struct proc *p = myproc();
+  struct timerq *q;
+  struct timer t;
+
+  if(when <= timenow())
+    return 0;
+
+  t.when = when;
+  t.fired = 0;
+
+  // queue the timer on this hart, which must stay put
+  // until it has programmed MTIMECMP.
+  push_off();
+  q = &timerqs[cpuid()];
+  acquire(&q->lock);
+  pop_off();
+  heapinsert(q, &t);
+  if(q->heap[0] == &t)
+    timerset();
+
+  // timerintr() holds q->lock to fire t, so the wakeup
+  // can't be lost, whichever hart p wakes up on.
+  while(!t.fired){
+    if(p->killed){
+      heapremove(q, &t);
+      release(&q->lock);
+      return -1;
+    }
+    sleep(&t, &q->lock);
+  }
+  release(&q->lock);
+  return 0;
+}
@@ -3,25 +3,21 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
-struct spinlock tickslock;
-uint ticks;
-
 extern char trampoline[], uservec[], userret[];
 
+// start.c; timervec sets TIMER_FIRED for devintr().
+extern uint64 timer_scratch[NCPU][6];
+#define TIMER_FIRED 5
+
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
 extern int devintr();
 
-void
-trapinit(void)
-{
-  initlock(&tickslock, "time");
-}
-
 // set up to take exceptions and traps while in the kernel.
 void
 trapinithart(void)
@@ -85,8 +81,10 @@ usertrap(void)
     exit(-1);
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  if(which_dev == 2){
+    rcu_poll();
     yield();
+  }
 
   usertrapret();
 }
@@ -104,6 +102,9 @@ usertrapret(void)
   // we're back in user space, where usertrap() is correct.
   intr_off();
 
+  // no kernel read-side sections survive into user space.
+  rcu_qs();
+
   // send syscalls, interrupts, and exceptions to trampoline.S
   w_stvec(TRAMPOLINE + (uservec - trampoline));
 
@@ -127,13 +128,15 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->mm->pagetable);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
+  // threads sharing a page table each have their own
+  // trapframe mapping, so pass this thread's.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(p->tfva, satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -158,8 +161,11 @@ kerneltrap()
   }
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // interrupts were on, so no read-side section was running.
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING){
+    rcu_poll();
     yield();
+  }
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -167,18 +173,18 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// interrupt another hart. it arrives at timervec in
+// kernelvec.S as a machine-mode software interrupt, and
+// then at devintr() as a supervisor software interrupt.
 void
-clockintr()
+sendipi(int hart)
 {
-  acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
-  release(&tickslock);
+  *(uint32*)CLINT_MSIP(hart) = 1;
 }
 
 // check if it's an external interrupt or software interrupt,
 // and handle it.
-// returns 2 if timer interrupt,
+// returns 2 if the running process's time slice is over,
 // 1 if other device,
 // 0 if not recognized.
 int
@@ -209,18 +215,27 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
+    struct cpu *c = mycpu();
+    int timer;
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
+    // the SSIP bit in sip, before looking at why it
+    // was raised, so that a new reason raises it again.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    if(c->tlbflush){
+      // tlbshootdown() on another hart.
+      sfence_vma();
+      __sync_lock_release(&c->tlbflush);
+    }
+
+    timer = __sync_lock_test_and_set(&timer_scratch[cpuid()][TIMER_FIRED], 0);
+    if(timer && timerintr())
+      return 2;
+
+    return 1;
   } else {
     return 0;
   }
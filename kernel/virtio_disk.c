@@ -20,7 +20,12 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// the device's queues: one per hart, if it offers that many.
+#define NVQ NCPU
+
+// one virtqueue, with its own lock, so that harts using
+// different queues don't contend.
+struct vq {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
   // global (instead of calls to kalloc()) because it must consist of
@@ -61,8 +66,10 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
     char status;
+    void (*done)(void *);       // from virtio_disk_submit()
+    void *arg;                  // for done
+    int *flushed;               // for virtio_disk_flush()
   } info[NUM];
 
   // disk command headers.
@@ -70,15 +77,23 @@ static struct disk {
   struct virtio_blk_req ops[NUM];
   
   struct spinlock vdisk_lock;
-  
-} __attribute__ ((aligned (PGSIZE))) disk;
+} __attribute__ ((aligned (PGSIZE)));
+
+static struct disk {
+  struct vq vq[NVQ];
+  int nvq;          // queues in use
+
+  // did the device offer VIRTIO_BLK_F_FLUSH? then it may hold
+  // written blocks in a volatile cache until told to flush.
+  int canflush;
+} disk;
 
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
-
-  initlock(&disk.vdisk_lock, "virtio_disk");
+  struct vq *vq;
+  int q;
 
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 1 ||
@@ -98,11 +113,21 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.canflush = (features >> VIRTIO_BLK_F_FLUSH) & 1;
+
+  // with VIRTIO_BLK_F_MQ, the device says in its configuration
+  // how many queues it has; otherwise it has one.
+  disk.nvq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ))
+    disk.nvq = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_NUM_QUEUES);
+  if(disk.nvq > NVQ)
+    disk.nvq = NVQ;
+  if(disk.nvq < 1)
+    disk.nvq = 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -114,39 +139,69 @@ virtio_disk_init(void)
 
   *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
-
-  // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
-
-  disk.desc = (struct virtq_desc *) disk.pages;
-  disk.avail = (struct virtq_avail *)(disk.pages + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (disk.pages + PGSIZE);
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  if(NUM*sizeof(struct virtq_desc) + sizeof(struct virtq_avail) > PGSIZE)
+    panic("virtio disk queue too long");
+  if(NUM < MAXIOBLOCKS+2)
+    panic("virtio disk queue too short for MAXIOBLOCKS");
+
+  for(q = 0; q < disk.nvq; q++){
+    vq = &disk.vq[q];
+    initlock(&vq->vdisk_lock, "virtio_disk");
+
+    // initialize queue q.
+    *R(VIRTIO_MMIO_QUEUE_SEL) = q;
+    uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if(max == 0)
+      panic("virtio disk has no queue");
+    if(max < NUM)
+      panic("virtio disk max queue too short");
+    *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+    memset(vq->pages, 0, sizeof(vq->pages));
+    *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)vq->pages) >> PGSHIFT;
+
+    // desc = pages -- num * virtq_desc
+    // avail = pages + 0x40 -- 2 * uint16, then num * uint16
+    // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+
+    vq->desc = (struct virtq_desc *) vq->pages;
+    vq->avail = (struct virtq_avail *)(vq->pages + NUM*sizeof(struct virtq_desc));
+    vq->used = (struct virtq_used *) (vq->pages + PGSIZE);
+
+    // all NUM descriptors start out unused.
+    for(int i = 0; i < NUM; i++)
+      vq->free[i] = 1;
+  }
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
+// how many queues the disk has. queue q is best used by
+// the harts whose cpuid() % virtio_disk_nqueue() is q.
+int
+virtio_disk_nqueue(void)
+{
+  return disk.nvq;
+}
+
+// this hart's queue.
+static struct vq*
+myvq(void)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+  return &disk.vq[id % disk.nvq];
+}
+
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vq *vq)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(vq->free[i]){
+      vq->free[i] = 0;
       return i;
     }
   }
@@ -155,28 +210,28 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vq *vq, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(vq->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  vq->desc[i].addr = 0;
+  vq->desc[i].len = 0;
+  vq->desc[i].flags = 0;
+  vq->desc[i].next = 0;
+  vq->free[i] = 1;
+  wakeup(&vq->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vq *vq, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = vq->desc[i].flags;
+    int nxt = vq->desc[i].next;
+    free_desc(vq, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -184,46 +239,73 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// a disk transfer of k blocks uses k+2 descriptors.
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct vq *vq, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(vq);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(vq, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// how many blocks in the request that b heads: b, then
+// b->ionext, and so on, holding consecutive blocks.
+static int
+nblocks(struct buf *b)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  int n;
+
+  for(n = 0; b; b = b->ionext){
+    if(++n > MAXIOBLOCKS)
+      panic("virtio_disk: request too long");
+    if(b->ionext && (b->ionext->dev != b->dev || b->ionext->blockno != b->blockno + 1))
+      panic("virtio_disk: blocks not consecutive");
+  }
+  return n;
+}
 
-  acquire(&disk.vdisk_lock);
+// put the chain of descriptors that starts at idx0 on the
+// avail ring, and tell the device.
+// caller holds vq->vdisk_lock.
+static void
+notify(struct vq *vq, int idx0)
+{
+  // tell the device the first index in our chain of descriptors.
+  vq->avail->ring[vq->avail->idx % NUM] = idx0;
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  __sync_synchronize();
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
+  // tell the device another avail ring entry is available.
+  vq->avail->idx += 1; // not % NUM ...
 
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
+  __sync_synchronize();
+
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = vq - disk.vq; // value is queue number
+}
+
+// hand the device a request to read or write the n blocks that
+// b heads, using the n+2 descriptors in idx. virtio_disk_intr()
+// will call done(arg).
+// caller holds vq->vdisk_lock.
+static void
+post(struct vq *vq, struct buf *b, int n, int write, int *idx,
+     void (*done)(void *), void *arg)
+{
+  uint64 sector = b->blockno * (BSIZE / 512);
+  struct buf *x;
+  int i;
+
+  // format the descriptors: a header, one per block, and a
+  // status byte. qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &vq->ops[idx[0]];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -232,84 +314,184 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  vq->desc[idx[0]].addr = (uint64) buf0;
+  vq->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  vq->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  vq->desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 1, x = b; i <= n; i++, x = x->ionext){
+    vq->desc[idx[i]].addr = (uint64) x->data;
+    vq->desc[idx[i]].len = BSIZE;
+    if(write)
+      vq->desc[idx[i]].flags = 0; // device reads x->data
+    else
+      vq->desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes x->data
+    vq->desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    vq->desc[idx[i]].next = idx[i+1];
+    x->disk = 1;
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  vq->info[idx[0]].status = 0xff; // device writes 0 on success
+  vq->desc[idx[n+1]].addr = (uint64) &vq->info[idx[0]].status;
+  vq->desc[idx[n+1]].len = 1;
+  vq->desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  vq->desc[idx[n+1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the callback for virtio_disk_intr().
+  vq->info[idx[0]].done = done;
+  vq->info[idx[0]].arg = arg;
 
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  notify(vq, idx[0]);
+}
 
-  __sync_synchronize();
+// Start reading (write == 0) or writing the blocks that b heads,
+// on queue q, and return without waiting for the disk. b can
+// head a list of bufs, linked through ionext, holding up to
+// MAXIOBLOCKS consecutive blocks, to move them all in one
+// request. virtio_disk_intr() calls done(arg) once they've
+// all been moved, with no locks held, leaving the list linked and
+// the bufs' disk set for done to clear. Returns -1, and doesn't
+// start, if the queue is full, so that callers needn't be able
+// to sleep.
+int
+virtio_disk_submit(int q, struct buf *b, int write, void (*done)(void *), void *arg)
+{
+  int n = nblocks(b);
+  int idx[MAXIOBLOCKS+2];
+  struct vq *vq = &disk.vq[q];
+
+  acquire(&vq->vdisk_lock);
+  if(alloc_descs(vq, idx, n+2) < 0){
+    release(&vq->vdisk_lock);
+    return -1;
+  }
+  post(vq, b, n, write, idx, done, arg);
+  release(&vq->vdisk_lock);
+  return 0;
+}
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+// Wait until every write the disk has finished is durable, not
+// just in the disk's cache. A no-op if the disk has no cache
+// that needs flushing.
+void
+virtio_disk_flush(void)
+{
+  int idx[2];
+  int flushed = 0;
+  struct vq *vq;
 
-  __sync_synchronize();
+  if(!disk.canflush)
+    return;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  vq = myvq();
+  acquire(&vq->vdisk_lock);
+  while(alloc_descs(vq, idx, 2) < 0)
+    sleep(&vq->free[0], &vq->vdisk_lock);
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
-  }
+  // a flush is a header and a status byte, with no data.
+  struct virtio_blk_req *buf0 = &vq->ops[idx[0]];
+  buf0->type = VIRTIO_BLK_T_FLUSH;
+  buf0->reserved = 0;
+  buf0->sector = 0;
+
+  vq->desc[idx[0]].addr = (uint64) buf0;
+  vq->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  vq->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  vq->desc[idx[0]].next = idx[1];
+
+  vq->info[idx[0]].status = 0xff;
+  vq->desc[idx[1]].addr = (uint64) &vq->info[idx[0]].status;
+  vq->desc[idx[1]].len = 1;
+  vq->desc[idx[1]].flags = VRING_DESC_F_WRITE;
+  vq->desc[idx[1]].next = 0;
+
+  vq->info[idx[0]].flushed = &flushed;
+  notify(vq, idx[0]);
+
+  while(!flushed)
+    sleep(&flushed, &vq->vdisk_lock);
+  release(&vq->vdisk_lock);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// finish the requests the device has put on vq's used ring.
+// caller holds vq->vdisk_lock.
+static void
+complete(struct vq *vq)
+{
+  // the device increments vq->used->idx when it
+  // adds an entry to the used ring.
+
+  while(vq->used_idx != vq->used->idx){
+    __sync_synchronize();
+    int id = vq->used->ring[vq->used_idx % NUM].id;
 
-  release(&disk.vdisk_lock);
+    if(vq->info[id].status != 0)
+      panic("virtio_disk_intr status");
+
+    void (*done)(void *) = vq->info[id].done;
+    void *arg = vq->info[id].arg;
+    int *flushed = vq->info[id].flushed;
+    vq->used_idx += 1;
+
+    // free the chain here, rather than in the waiter, so that
+    // the next request can have it right away.
+    vq->info[id].done = 0;
+    vq->info[id].arg = 0;
+    vq->info[id].flushed = 0;
+    free_chain(vq, id);
+
+    if(flushed){
+      *flushed = 1;
+      wakeup(flushed);
+    } else {
+      // the request's bufs, their ionext and disk, are
+      // done's to deal with.
+      release(&vq->vdisk_lock);
+      done(arg);
+      acquire(&vq->vdisk_lock);
+    }
+  }
 }
 
+// the device has one interrupt for all its queues, so look
+// at each of them; a queue whose used ring hasn't moved is
+// passed over without taking its lock.
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
+  struct vq *vq;
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
+  // the "used" rings, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
+  for(vq = disk.vq; vq < &disk.vq[disk.nvq]; vq++){
+    if(vq->used_idx == *(volatile uint16 *)&vq->used->idx)
+      continue;
+    acquire(&vq->vdisk_lock);
+    complete(vq);
+    release(&vq->vdisk_lock);
   }
+}
+
+// Finish whatever requests queue q has finished, without
+// waiting for the interrupt, for a caller that is spinning
+// until its request is done. The interrupt, when it comes,
+// finds nothing left, which is harmless.
+void
+virtio_disk_poll(int q)
+{
+  struct vq *vq = &disk.vq[q];
 
-  release(&disk.vdisk_lock);
+  if(vq->used_idx == *(volatile uint16 *)&vq->used->idx)
+    return;
+  acquire(&vq->vdisk_lock);
+  complete(vq);
+  release(&vq->vdisk_lock);
 }
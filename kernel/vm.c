@@ -6,8 +6,8 @@
 #include "defs.h"
 #include "fs.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "file.h"
 #include "fcntl.h"
 
@@ -35,6 +35,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for sending IPIs to other harts
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -48,9 +51,8 @@ kvmmake(void)
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // map kernel stacks
-  proc_mapstacks(kpgtbl);
-  
+  // kernel stacks are mapped by allocproc(), as procs are created.
+
   return kpgtbl;
 }
 
@@ -267,6 +269,58 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   return newsz;
 }
 
+// Remove npages of mappings starting from va from an address
+// space that other threads may be running in, and free the
+// physical memory. The PTEs are invalidated first, and the
+// pages freed only after tlbshootdown(), so that no hart can
+// still reach a page once it is back on the free list.
+// Lazily-mapped mmap pages that never got memory are fine.
+// Caller must hold mm->vmlock.
+void
+uvmunmapshared(struct mm_struct *mm, uint64 va, uint64 npages)
+{
+  uint64 a;
+  pte_t *pte;
+
+  if((va % PGSIZE) != 0)
+    panic("uvmunmapshared: not aligned");
+
+  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+    if((pte = walk(mm->pagetable, a, 0)) == 0)
+      panic("uvmunmapshared: walk");
+    if((*pte & PTE_V) == 0)
+      panic("uvmunmapshared: not mapped");
+    *pte &= ~PTE_V; // keep the PPN until after the shootdown
+  }
+
+  tlbshootdown(mm);
+
+  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+    pte = walk(mm->pagetable, a, 0);
+    uint64 pa = PTE2PA(*pte);
+    if(pa)
+      kfree((void*)pa);
+    *pte = 0;
+  }
+}
+
+// Like uvmdealloc(), but for an address space that
+// other threads may be running in.
+// Caller must hold mm->vmlock.
+uint64
+uvmdeallocshared(struct mm_struct *mm, uint64 oldsz, uint64 newsz)
+{
+  if(newsz >= oldsz)
+    return oldsz;
+
+  if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
+    int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
+    uvmunmapshared(mm, PGROUNDUP(newsz), npages);
+  }
+
+  return newsz;
+}
+
 // Recursively free page-table pages.
 // All leaf mappings must already have been removed.
 void
@@ -439,11 +493,13 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   }
 }
 
-int handlepgfault(uint64 va) {
-  struct proc *p = myproc();
+// Fill in the page of an mmap()ed file at va, which
+// was reserved by vmmap(). Caller must hold mm->vmlock.
+static int
+mmfault(struct mm_struct *mm, uint64 va) {
   struct vm_area_struct *vmarea;
 
-  for(vmarea = p->mmap; vmarea; vmarea = vmarea->vm_next) {
+  for(vmarea = mm->mmap; vmarea; vmarea = vmarea->vm_next) {
     if(va >= PGROUNDDOWN(vmarea->vm_start) && va < PGROUNDUP(vmarea->vm_end)) {
       break;
     }
@@ -458,19 +514,26 @@ int handlepgfault(uint64 va) {
   memset(pa, 0, PGSIZE);
 
   uint64 offset = va - vmarea->vm_start + vmarea->vm_off;
-  ilock(vmarea->vm_file->ip);
+  ilockshared(vmarea->vm_file->ip);
   int rn = readi(vmarea->vm_file->ip, 0, (uint64)pa, offset, PGSIZE);
-  iunlock(vmarea->vm_file->ip);
+  iunlockshared(vmarea->vm_file->ip);
   if(rn == 0) {
     printf("read out of file range\n");
+    kfree(pa);
     return -1;
   }
 
-  pte_t *pte = walk(p->pagetable, va, 0);
+  pte_t *pte = walk(mm->pagetable, va, 0);
   if((*pte & PTE_V) == 0) {
     printf("mmap page no PTE_V\n");
+    kfree(pa);
     return -1;
   }
+  if(PTE2PA(*pte) != 0) {
+    // another thread faulted the page in first.
+    kfree(pa);
+    return 0;
+  }
   int prot = vmarea->vm_prot;
   int flags = PTE_U | PTE_V;
   if(prot & PROT_READ) flags |= PTE_R;
@@ -478,4 +541,29 @@ int handlepgfault(uint64 va) {
   if(prot & PROT_EXEC) flags |= PTE_X;
   *pte = PA2PTE(pa) | flags;
   return 0;
-}
\ No newline at end of file
+}
+
+// Handle a page fault at va in the current process.
+// Returns -1 if va is not part of a VMA.
+int handlepgfault(uint64 va) {
+  struct mm_struct *mm = myproc()->mm;
+  int r;
+
+  acquiresleep(&mm->vmlock);
+  r = mmfault(mm, va);
+  releasesleep(&mm->vmlock);
+  return r;
+}
+
+// Like walkaddr(), but first fill in va's page if it is an
+// mmap()ed page that hasn't been touched yet. Caller must hold
+// mm->vmlock, for as long as it uses the page.
+uint64
+walkaddrfault(struct mm_struct *mm, uint64 va)
+{
+  uint64 pa;
+
+  if((pa = walkaddr(mm->pagetable, va)) == 0 && mmfault(mm, va) == 0)
+    pa = walkaddr(mm->pagetable, va);
+  return pa;
+}
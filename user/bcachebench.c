@@ -0,0 +1,193 @@
+//
+// measure buffer cache hit rates for small, often-used files
+// (the inode, directory and data blocks of a working set), alone
+// and while a big file is read straight through again and again.
+// memory is used up first, so that the cache can't grow to hold
+// everything. build with BUF2Q 0 in kernel/param.h to compare
+// with plain LRU.
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NSMALL 8      // files in the working set
+#define NBIG 200      // blocks in the big file
+#define NSTREAM 40    // blocks of it read per round
+#define ROUNDS 50
+
+char buf[BSIZE];
+char report[4096];
+
+// the cache's total hits and misses, from lockstat().
+void
+counts(uint *hits, uint *misses)
+{
+  char *p;
+
+  if(lockstat(0, report, sizeof(report)) < 0){
+    fprintf(2, "bcachebench: lockstat failed\n");
+    exit(1);
+  }
+  for(p = report; *p; p++)
+    if(memcmp(p, "bcache:", 7) == 0)
+      break;
+  if(*p == 0){
+    fprintf(2, "bcachebench: no bcache counts\n");
+    exit(1);
+  }
+  // "bcache: N bufs, N on probation, N hits, N misses"
+  while(*p && *p != ',') p++;
+  p++;
+  while(*p && *p != ',') p++;
+  *hits = atoi(p + 2);
+  p++;
+  while(*p && *p != ',') p++;
+  *misses = atoi(p + 2);
+}
+
+void
+smallname(char *name, int i)
+{
+  strcpy(name, "bcb/s0");
+  name[5] = '0' + i;
+}
+
+void
+readsmall(void)
+{
+  char name[8];
+  struct stat st;
+  int i, fd;
+
+  for(i = 0; i < NSMALL; i++){
+    smallname(name, i);
+    if(stat(name, &st) < 0 || (fd = open(name, O_RDONLY)) < 0){
+      fprintf(2, "bcachebench: open %s failed\n", name);
+      exit(1);
+    }
+    read(fd, buf, sizeof(buf));
+    close(fd);
+  }
+}
+
+void
+setup(void)
+{
+  char name[8];
+  int i, fd;
+
+  mkdir("bcb");
+  for(i = 0; i < NSMALL; i++){
+    smallname(name, i);
+    if((fd = open(name, O_CREATE|O_WRONLY)) < 0){
+      fprintf(2, "bcachebench: create %s failed\n", name);
+      exit(1);
+    }
+    memset(buf, 'a' + i, sizeof(buf));
+    write(fd, buf, sizeof(buf));
+    close(fd);
+  }
+  if((fd = open("bcb/big", O_CREATE|O_WRONLY)) < 0){
+    fprintf(2, "bcachebench: create bcb/big failed\n");
+    exit(1);
+  }
+  for(i = 0; i < NBIG; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      fprintf(2, "bcachebench: write bcb/big failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+cleanup(void)
+{
+  char name[8];
+  int i;
+
+  for(i = 0; i < NSMALL; i++){
+    smallname(name, i);
+    unlink(name);
+  }
+  unlink("bcb/big");
+  unlink("bcb");
+}
+
+// allocate nearly all of memory, so that kalloc() shrinks the
+// buffer cache and bget() can't grow it.
+void
+squeeze(void)
+{
+  char *a;
+
+  while((a = sbrk(1 << 20)) != (char*)-1)
+    ;
+  while((a = sbrk(4096)) != (char*)-1)
+    ;
+  // leave a little for the kernel.
+  sbrk(-64 * 4096);
+}
+
+void
+pct(char *what, uint hits, uint misses)
+{
+  uint n = hits + misses;
+
+  printf("%s: %d hits, %d misses, %d%% hit rate\n", what, hits, misses,
+         n ? hits * 100 / n : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint h0, m0, h1, m1, smallh = 0, smallm = 0, bigh = 0, bigm = 0;
+  int i, j, fd, off;
+
+  setup();
+  squeeze();
+
+  // the working set alone.
+  readsmall();
+  counts(&h0, &m0);
+  for(i = 0; i < ROUNDS; i++)
+    readsmall();
+  counts(&h1, &m1);
+  pct("working set alone", h1 - h0, m1 - m0);
+
+  // and again, between stretches of the big file.
+  if((fd = open("bcb/big", O_RDONLY)) < 0){
+    fprintf(2, "bcachebench: open bcb/big failed\n");
+    exit(1);
+  }
+  off = 0;
+  for(i = 0; i < ROUNDS; i++){
+    counts(&h0, &m0);
+    for(j = 0; j < NSTREAM; j++){
+      if(off == NBIG){
+        close(fd);
+        fd = open("bcb/big", O_RDONLY);
+        off = 0;
+      }
+      read(fd, buf, sizeof(buf));
+      off++;
+    }
+    counts(&h1, &m1);
+    bigh += h1 - h0;
+    bigm += m1 - m0;
+    readsmall();
+    counts(&h0, &m0);
+    smallh += h0 - h1;
+    smallm += m0 - m1;
+  }
+  close(fd);
+  pct("working set with streaming", smallh, smallm);
+  pct("streaming", bigh, bigm);
+
+  cleanup();
+  exit(0);
+}
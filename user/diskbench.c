@@ -0,0 +1,107 @@
+//
+// compare how long processes wait for the disk when they sleep
+// until its interrupt, when they spin first, and when they spin
+// only while the disk has been quick (diskpoll() modes 0, 1, 2).
+// each round does small writes, each followed by an fsync()
+// that waits for its transaction to commit, and prints the
+// distribution of waits from lockstat()'s "iosched waits" line.
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/diskpoll.h"
+#include "user/user.h"
+
+#define NOPS 200
+#define NHIST 16
+
+char report[4096];
+char buf[64];
+
+// the histogram of waits, from lockstat().
+void
+waits(uint *hist)
+{
+  char *p;
+  int i;
+
+  if(lockstat(0, report, sizeof(report)) < 0){
+    fprintf(2, "diskbench: lockstat failed\n");
+    exit(1);
+  }
+  for(p = report; *p; p++)
+    if(memcmp(p, "iosched waits", 13) == 0)
+      break;
+  if(*p == 0){
+    fprintf(2, "diskbench: no iosched waits in lockstat\n");
+    exit(1);
+  }
+  while(*p && *p != ':') p++;
+  for(i = 0; i < NHIST; i++){
+    while(*p == ' ' || *p == ':') p++;
+    hist[i] = atoi(p);
+    while(*p >= '0' && *p <= '9') p++;
+  }
+}
+
+void
+run(int mode, char *name)
+{
+  uint h0[NHIST], h1[NHIST], n;
+  int i, fd, t0, t1;
+
+  if(diskpoll(mode) < 0){
+    fprintf(2, "diskbench: diskpoll %d failed\n", mode);
+    exit(1);
+  }
+  if((fd = open("diskbench.tmp", O_CREATE|O_RDWR)) < 0){
+    fprintf(2, "diskbench: create failed\n");
+    exit(1);
+  }
+  waits(h0);
+  t0 = uptime();
+  for(i = 0; i < NOPS; i++){
+    memset(buf, i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      fprintf(2, "diskbench: write failed\n");
+      exit(1);
+    }
+    if(fsync(fd) < 0){
+      fprintf(2, "diskbench: fsync failed\n");
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  waits(h1);
+  close(fd);
+  unlink("diskbench.tmp");
+
+  n = 0;
+  for(i = 0; i < NHIST; i++)
+    n += h1[i] - h0[i];
+  printf("%s: %d writes in %d ticks, %d waits\n", name, NOPS, t1 - t0, n);
+  // mtime cycles are 100 ns.
+  for(i = 0; i < NHIST; i++){
+    if(h1[i] == h0[i])
+      continue;
+    if(i == NHIST - 1)
+      printf("  longer: %d\n", h1[i] - h0[i]);
+    else
+      printf("  < %d.%d us: %d\n", (1 << i) / 10, (1 << i) % 10, h1[i] - h0[i]);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int old;
+
+  old = diskpoll(-1);
+  run(DISKPOLL_OFF, "interrupts");
+  run(DISKPOLL_ON, "polling");
+  run(DISKPOLL_HYBRID, "hybrid");
+  diskpoll(old);
+  exit(0);
+}
@@ -0,0 +1,25 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// print the most contended spinlocks and sleep locks.
+char buf[4096];
+
+int
+main(int argc, char **argv)
+{
+  int n = 10;
+
+  if(argc > 2){
+    fprintf(2, "usage: lockstat [n]\n");
+    exit(1);
+  }
+  if(argc == 2)
+    n = atoi(argv[1]);
+  if(lockstat(n, buf, sizeof(buf)) < 0){
+    fprintf(2, "lockstat failed\n");
+    exit(1);
+  }
+  printf("%s", buf);
+  exit(0);
+}
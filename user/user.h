@@ -26,6 +26,15 @@ int uptime(void);
 void *mmap(void *addr, uint64 length, int prot, int flags,
            int fd, uint64 offset);
 int munmap(void *addr, uint64 length);
+int clone(void (*fn)(void*), void *stack, int flags, void *arg);
+int futex(volatile int*, int, int);
+int proclimit(int);
+int nanosleep(uint64);
+int lockstat(int, char*, int);
+int diskpoll(int);
+int fsync(int);
+int fdatasync(int);
+int bcachewat(int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -43,3 +52,19 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+// sleeping locks and condition variables for threads,
+// built on futex(). zero-filled means unlocked/idle.
+struct mutex {
+  volatile int state;   // 0 unlocked, 1 locked, 2 locked with waiters
+};
+struct cond {
+  volatile int seq;     // bumped by every signal
+};
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
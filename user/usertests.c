@@ -7,6 +7,8 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/sched.h"
+#include "kernel/futex.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2080,6 +2082,768 @@ forktest(char *s)
   }
 }
 
+// threads made by clone() share memory and open files,
+// and the creator collects them with wait().
+volatile int clonecount;
+int clonefd;
+
+void
+clonechild(void *arg)
+{
+  for(int i = 0; i < 1000; i++)
+    __sync_fetch_and_add(&clonecount, 1);
+  if(write(clonefd, "x", 1) != 1)
+    exit(1);
+  exit((int)(uint64)arg);
+}
+
+void
+clonetest(char *s)
+{
+  enum { N = 4 };
+  char *stacks[N];
+  int pids[N], i, xstatus, seen = 0;
+  char buf[N+1];
+
+  if((clonefd = open("clonefile", O_CREATE|O_RDWR)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    stacks[i] = malloc(PGSIZE);
+    pids[i] = clone(clonechild, stacks[i] + PGSIZE, CLONE_VM|CLONE_FILES,
+                    (void*)(uint64)(i + 10));
+    if(pids[i] < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    int pid = wait(&xstatus);
+    for(int j = 0; j < N; j++){
+      if(pid == pids[j] && xstatus == j + 10)
+        seen |= 1 << j;
+    }
+  }
+  if(seen != (1 << N) - 1){
+    printf("%s: wait returned wrong thread or status\n", s);
+    exit(1);
+  }
+  if(clonecount != N*1000){
+    printf("%s: threads do not share memory: %d\n", s, clonecount);
+    exit(1);
+  }
+  // each thread wrote one byte through the shared descriptor.
+  close(clonefd);
+  clonefd = open("clonefile", O_RDONLY);
+  if(read(clonefd, buf, sizeof(buf)) != N){
+    printf("%s: threads could not write clonefd\n", s);
+    exit(1);
+  }
+  close(clonefd);
+  unlink("clonefile");
+  for(i = 0; i < N; i++)
+    free(stacks[i]);
+
+  if(clone(clonechild, stacks[0] + 1, CLONE_VM, 0) >= 0 ||
+     clone(clonechild, stacks[0] + PGSIZE, 0, 0) >= 0){
+    printf("%s: clone accepted bad arguments\n", s);
+    exit(1);
+  }
+}
+
+void
+clonespin(void *arg)
+{
+  for(;;)
+    ;
+}
+
+// killing a process must kill its threads too.
+void
+clonekill(char *s)
+{
+  int pid, xstatus;
+
+  for(int i = 0; i < 20; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int j = 0; j < 3; j++){
+        char *stack = malloc(PGSIZE);
+        if(clone(clonespin, stack + PGSIZE, CLONE_VM, 0) < 0)
+          exit(1);
+      }
+      clonespin(0);
+    }
+    sleep(1);
+    kill(pid);
+    wait(&xstatus);
+    if(xstatus != -1){
+      printf("%s: status should be -1\n", s);
+      exit(1);
+    }
+  }
+}
+
+// a thread blocked reading a descriptor keeps using its file
+// while another thread closes that descriptor.
+int closefds[2];
+
+void
+closereader(void *arg)
+{
+  char c = 0;
+
+  if(read(closefds[0], &c, 1) != 1 || c != 'y')
+    exit(1);
+  exit(0);
+}
+
+void
+closeread(char *s)
+{
+  char *stack = malloc(PGSIZE);
+  int pid, xstatus;
+
+  if(pipe(closefds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = clone(closereader, stack + PGSIZE, CLONE_VM|CLONE_FILES, 0);
+  if(pid < 0){
+    printf("%s: clone failed\n", s);
+    exit(1);
+  }
+  sleep(1);  // let the reader block
+  if(close(closefds[0]) != 0){
+    printf("%s: close failed\n", s);
+    exit(1);
+  }
+  if(read(closefds[0], stack, 1) != -1){
+    printf("%s: read of a closed fd succeeded\n", s);
+    exit(1);
+  }
+  if(write(closefds[1], "y", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: blocked reader failed after close\n", s);
+    exit(1);
+  }
+  close(closefds[1]);
+  free(stack);
+}
+
+// threads contend for a futex-based mutex, and hand
+// work back and forth through a condition variable.
+struct mutex futexmu;
+struct cond futexcv;
+int futexcount;
+int futexturn;
+
+void
+futexchild(void *arg)
+{
+  int me = (int)(uint64)arg;
+
+  for(int i = 0; i < 500; i++){
+    mutex_lock(&futexmu);
+    futexcount++;   // not atomic; the mutex protects it
+    mutex_unlock(&futexmu);
+  }
+
+  // take turns in order 0, 1, 2, ...
+  mutex_lock(&futexmu);
+  while(futexturn != me)
+    cond_wait(&futexcv, &futexmu);
+  futexturn++;
+  cond_broadcast(&futexcv);
+  mutex_unlock(&futexmu);
+  exit(0);
+}
+
+void
+futextest(char *s)
+{
+  enum { N = 4 };
+  char *stacks[N];
+  int i, xstatus;
+  volatile int word = 7;
+
+  if(futex(&word, FUTEX_WAIT, 8) != -1){
+    printf("%s: FUTEX_WAIT slept on a changed value\n", s);
+    exit(1);
+  }
+  if(futex(&word, FUTEX_WAKE, 1) != 0){
+    printf("%s: FUTEX_WAKE woke a waiter that isn't there\n", s);
+    exit(1);
+  }
+  if(futex((volatile int*)((char*)&word + 1), FUTEX_WAKE, 1) != -1){
+    printf("%s: futex accepted an unaligned address\n", s);
+    exit(1);
+  }
+
+  mutex_init(&futexmu);
+  cond_init(&futexcv);
+  for(i = 0; i < N; i++){
+    stacks[i] = malloc(PGSIZE);
+    if(clone(futexchild, stacks[i] + PGSIZE, CLONE_VM, (void*)(uint64)i) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  if(futexcount != N*500 || futexturn != N){
+    printf("%s: count %d turn %d\n", s, futexcount, futexturn);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    free(stacks[i]);
+}
+
+// the process table grows on demand, up to a limit
+// that can be changed at run time.
+void
+proclimittest(char *s)
+{
+  enum { N = NPROC + 20 };
+  int old, live, fds[2], i, pid, pid2, xstatus;
+  char c;
+
+  old = proclimit(0);
+  if(proclimit(NPROCMAX + 1) != -1 || proclimit(0) != old){
+    printf("%s: proclimit accepted too big a limit\n", s);
+    exit(1);
+  }
+  if(proclimit(1) != -1){
+    proclimit(old);
+    printf("%s: proclimit accepted a limit below the live count\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+
+  // the smallest limit proclimit() accepts is the live count.
+  // leave room for exactly one more.
+  for(live = 2; live < NPROCMAX && proclimit(live) < 0; live++)
+    ;
+  proclimit(live + 1);
+  pid = fork();
+  if(pid == 0){
+    close(fds[1]);
+    read(fds[0], &c, 1);
+    exit(0);
+  }
+  pid2 = fork();
+  if(pid2 == 0)
+    exit(0);
+  proclimit(old);
+  close(fds[0]);
+  close(fds[1]);
+  while(wait(&xstatus) > 0)
+    ;
+  if(pid < 0){
+    printf("%s: fork failed below the limit\n", s);
+    exit(1);
+  }
+  if(pid2 > 0){
+    printf("%s: fork ignored the limit\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  proclimit(N + 10);
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork %d failed with a raised limit\n", s, i);
+      break;
+    }
+    if(pid == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  while(wait(&xstatus) > 0)
+    ;
+  proclimit(old);
+  if(i < N)
+    exit(1);
+}
+
+// nanosleep() sleeps for at least as long as asked,
+// and a kill() cuts it short.
+void
+nanosleeptest(char *s)
+{
+  int t0, t1, pid, xstatus;
+
+  t0 = uptime();
+  for(int i = 0; i < 30; i++){
+    if(nanosleep(10000000) != 0){   // 10 ms
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  // 300 ms is 3 ticks, give or take the one in progress.
+  if(t1 - t0 < 2 || t1 - t0 > 20){
+    printf("%s: 30 nanosleeps of 10ms took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    nanosleep(100ULL * 1000000000);   // 100 s
+    exit(0);
+  }
+  sleep(1);
+  kill(pid);
+  t0 = uptime();
+  wait(&xstatus);
+  if(xstatus != -1 || uptime() - t0 > 20){
+    printf("%s: kill did not end nanosleep\n", s);
+    exit(1);
+  }
+}
+
+// lockstat() fills in a terminated report of
+// the most contended spin and sleep locks, and
+// the disk queue's statistics.
+void
+lockstattest(char *s)
+{
+  static char buf[2048];
+  char *p;
+  int len;
+
+  len = lockstat(5, buf, sizeof(buf));
+  if(len <= 0 || len >= sizeof(buf) || buf[len] != 0){
+    printf("%s: lockstat returned %d\n", s, len);
+    exit(1);
+  }
+  if(strchr(buf, '\n') == 0){
+    printf("%s: bad lockstat report\n", s);
+    exit(1);
+  }
+  for(p = buf; p + 11 <= buf + len; p++)
+    if(memcmp(p, "sleep locks", 11) == 0)
+      break;
+  if(p + 11 > buf + len){
+    printf("%s: no sleep locks in lockstat report\n", s);
+    exit(1);
+  }
+  for(p = buf; p + 8 <= buf + len; p++)
+    if(memcmp(p, "iosched:", 8) == 0)
+      break;
+  if(p + 8 > buf + len){
+    printf("%s: no disk queue in lockstat report\n", s);
+    exit(1);
+  }
+  // a short buffer gets a truncated, terminated report.
+  if(lockstat(5, buf, 8) != 7 || buf[7] != 0){
+    printf("%s: lockstat overran a short buffer\n", s);
+    exit(1);
+  }
+}
+
+// the number of bufs in the block cache, from lockstat().
+int
+nbcache(void)
+{
+  static char buf[2048];
+  char *p;
+  int len;
+
+  len = lockstat(1, buf, sizeof(buf));
+  for(p = buf; p + 8 <= buf + len; p++)
+    if(memcmp(p, "bcache: ", 8) == 0)
+      return atoi(p + 8);
+  return -1;
+}
+
+// write the file bcacheshrinktest uses, if wr, with each
+// block filled by a letter that depends on pass, and check
+// that it reads back.
+void
+bcachefile(char *s, int pass, int wr)
+{
+  static char buf[BSIZE];
+  int fd, i, j;
+
+  if(wr){
+    fd = open("bcacheshrink", O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < 4*NBUF; i++){
+      memset(buf, 'a' + (i + pass) % 26, BSIZE);
+      if(write(fd, buf, BSIZE) != BSIZE){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  fd = open("bcacheshrink", O_RDONLY);
+  for(i = 0; i < 4*NBUF; i++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < BSIZE; j++){
+      if(buf[j] != 'a' + (i + pass) % 26){
+        printf("%s: wrong data in block %d\n", s, i);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+}
+
+// the block cache grows while memory is plentiful, gives
+// its pages back when a process uses up the rest, and
+// still caches files afterwards.
+void
+bcacheshrinktest(char *s)
+{
+  int n, m, pid, xstatus;
+
+  // grow until only BUFLOWAT pages are free.
+  if(bcachewat(BUFLOWAT-1, BUFLOWAT+1) != -1 || bcachewat(BUFLOWAT, -1) < 0){
+    printf("%s: bcachewat failed\n", s);
+    exit(1);
+  }
+  bcachefile(s, 0, 1);
+  n = nbcache();
+  if(n <= NBUF){
+    printf("%s: the cache didn't grow: %d bufs\n", s, n);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    while(sbrk(16*PGSIZE) != (char*)-1)
+      ;
+    while(sbrk(PGSIZE) != (char*)-1)
+      ;
+    // leave lockstat() a page for its report.
+    sbrk(-16*PGSIZE);
+    m = nbcache();
+    if(m < 0 || m >= n){
+      printf("%s: out of memory, but %d bufs, was %d\n", s, m, n);
+      exit(1);
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+
+  // the file's blocks were given back: read them in again,
+  // and rewrite them.
+  bcachefile(s, 0, 0);
+  bcachefile(s, 1, 1);
+  unlink("bcacheshrink");
+  bcachewat(BUFHIWAT, BUFLOWAT);
+}
+
+// fsync() and fdatasync() wait for a file's changes to be
+// committed, and refuse a pipe or a closed descriptor.
+void
+fsynctest(char *s)
+{
+  static char buf[3000];
+  int fd, fds[2], i;
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 26;
+  fd = open("fsyncf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(write(fd, buf, sizeof(buf)) != sizeof(buf) || fdatasync(fd) != 0){
+    printf("%s: write or fdatasync failed\n", s);
+    exit(1);
+  }
+  if(write(fd, buf, 10) != 10 || fsync(fd) != 0 || fsync(fd) != 0){
+    printf("%s: write or fsync failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(fsync(fd) != -1){
+    printf("%s: fsync of a closed fd succeeded\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1 || fdatasync(fds[1]) != -1){
+    printf("%s: fsync of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  fd = open("fsyncf", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[26] != 'a'){
+    printf("%s: read back failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("fsyncf");
+}
+
+// truncating a file with an indirect block frees it, and blocks
+// freed by a transaction that hasn't committed mustn't be reused
+// for file data, which is written in place; log_data() panics if
+// they are. have two processes truncate and rewrite files at
+// once, so that frees and reallocations land in the same
+// transactions, and check the data.
+void
+freereusetest(char *s)
+{
+  enum { N = 20, SZ = (NDIRECT+2)*BSIZE };
+  static char buf[SZ];
+  char *name;
+  int pid, fd, i, j, xstatus;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  name = pid == 0 ? "freereuse0" : "freereuse1";
+  for(i = 0; i < N; i++){
+    fd = open(name, O_CREATE|O_TRUNC|O_RDWR);
+    if(fd < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    memset(buf, 'a' + i + (pid == 0), SZ);
+    if(write(fd, buf, SZ) != SZ){
+      printf("%s: write %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    memset(buf, 0, SZ);
+    fd = open(name, O_RDONLY);
+    if(fd < 0 || read(fd, buf, SZ) != SZ){
+      printf("%s: read %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    for(j = 0; j < SZ; j++){
+      if(buf[j] != 'a' + i + (pid == 0)){
+        printf("%s: %s has the wrong data\n", s, name);
+        exit(1);
+      }
+    }
+  }
+  unlink(name);
+  if(pid == 0)
+    exit(0);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+}
+
+// several processes look up, stat and read the same
+// directory and file at once, sharing the inode locks,
+// while another one keeps creating and removing a
+// neighbour in the same directory.
+void
+sharedlookup(char *s)
+{
+  enum { N = 4, LOOPS = 200 };
+  char buf[16];
+  struct stat st;
+  int fd, i, j, pid, xstatus;
+
+  if(mkdir("sldir") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  fd = open("sldir/f", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, "shared", 6) != 6){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < N+1; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < LOOPS; j++){
+        if(i == N){
+          fd = open("sldir/g", O_CREATE|O_RDWR);
+          if(fd < 0)
+            exit(1);
+          close(fd);
+          unlink("sldir/g");
+          continue;
+        }
+        fd = open("sldir/f", O_RDONLY);
+        if(fd < 0 || fstat(fd, &st) < 0 || st.size != 6)
+          exit(1);
+        if(read(fd, buf, sizeof(buf)) != 6 || memcmp(buf, "shared", 6) != 0)
+          exit(1);
+        close(fd);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < N+1; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: concurrent lookup failed\n", s);
+      exit(1);
+    }
+  }
+  unlink("sldir/f");
+  unlink("sldir");
+}
+
+// kill() finds procs by pid without locks, while other
+// procs are being created and freed all the time.
+void
+killchurn(char *s)
+{
+  enum { N = 50 };
+  int churner, i, pid, xstatus;
+
+  churner = fork();
+  if(churner < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(churner == 0){
+    // create and free procs, and so rearrange the pid hash.
+    for(;;){
+      pid = fork();
+      if(pid == 0)
+        exit(0);
+      if(pid > 0)
+        wait(0);
+    }
+  }
+
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(;;)
+        ;
+    }
+    if(kill(pid) < 0){
+      printf("%s: kill %d failed\n", s, pid);
+      exit(1);
+    }
+    if(wait(&xstatus) != pid || xstatus != -1){
+      printf("%s: killed child did not exit\n", s);
+      exit(1);
+    }
+    // a pid that has been waited for is gone.
+    if(kill(pid) == 0){
+      printf("%s: killed a freed pid\n", s);
+      exit(1);
+    }
+  }
+  kill(churner);
+  wait(0);
+}
+
+// several processes write and read back their own files
+// at once, so buffers are recycled between hash buckets
+// while other buckets are being looked up.
+void
+bcachetest(char *s)
+{
+  enum { N = 4, NBLOCK = 20 };
+  static char buf[BSIZE];
+  char name[3];
+  int fd, i, j, k, pid, xstatus;
+
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      name[0] = 'b';
+      name[1] = '0' + i;
+      name[2] = 0;
+      fd = open(name, O_CREATE|O_RDWR);
+      if(fd < 0)
+        exit(1);
+      for(j = 0; j < NBLOCK; j++){
+        memset(buf, 'a' + (i + j) % 26, sizeof(buf));
+        if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+          exit(1);
+      }
+      close(fd);
+      fd = open(name, O_RDONLY);
+      if(fd < 0)
+        exit(1);
+      for(j = 0; j < NBLOCK; j++){
+        if(read(fd, buf, sizeof(buf)) != sizeof(buf))
+          exit(1);
+        for(k = 0; k < sizeof(buf); k++)
+          if(buf[k] != 'a' + (i + j) % 26)
+            exit(1);
+      }
+      close(fd);
+      unlink(name);
+      exit(0);
+    }
+  }
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: concurrent file I/O failed\n", s);
+      exit(1);
+    }
+  }
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2880,6 +3644,19 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {clonetest, "clonetest"},
+    {clonekill, "clonekill"},
+    {closeread, "closeread"},
+    {futextest, "futextest"},
+    {proclimittest, "proclimittest"},
+    {nanosleeptest, "nanosleeptest"},
+    {lockstattest, "lockstattest"},
+    {sharedlookup, "sharedlookup"},
+    {killchurn, "killchurn"},
+    {bcachetest, "bcachetest"},
+    {bcacheshrinktest, "bcacheshrinktest"},
+    {fsynctest, "fsynctest"},
+    {freereusetest, "freereusetest"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
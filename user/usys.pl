@@ -37,4 +37,13 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("mmap");
-entry("munmap");
\ No newline at end of file
+entry("munmap");
+entry("clone");
+entry("futex");
+entry("proclimit");
+entry("nanosleep");
+entry("lockstat");
+entry("diskpoll");
+entry("fsync");
+entry("fdatasync");
+entry("bcachewat");
\ No newline at end of file